@@ -7,15 +7,34 @@
 */
 
 #define	FUSE_USE_VERSION 26
+//for O_DIRECT
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <math.h>
-
-//size of a disk block
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+
+#include "cs1550_ioctl.h"
+
+//size of a disk block, not the 1024 linux/fs.h (through linux/io_uring.h) has
+#undef BLOCK_SIZE
 #define	BLOCK_SIZE 512
 
 //we'll use 8.3 filenames
@@ -95,750 +114,4827 @@ struct cs1550_disk_block
 
 typedef struct cs1550_disk_block cs1550_disk_block;
 
-/*This method opens the .disk file, and reads
- *in a the root block and returns it.
+/*
+ *Tracing. TRACE() calls above CS1550_TRACE_LEVEL compile to nothing, so
+ *the hot paths don't pay for them (build with -DCS1550_TRACE_LEVEL=3 to
+ *get everything). Events that are compiled in are formatted into a ring
+ *buffer in memory instead of stderr. Writers claim a slot with an atomic
+ *increment and never block each other; the newest TRACE_SLOTS events are
+ *written to stderr on SIGUSR1 and at unmount.
  */
-static cs1550_root_directory* readRoot(){
+#define TRACE_OFF 0
+#define TRACE_ERROR 1
+#define TRACE_INFO 2
+#define TRACE_DEBUG 3
 
-		cs1550_root_directory* root = (cs1550_root_directory *)malloc(sizeof(cs1550_root_directory));
+#ifndef CS1550_TRACE_LEVEL
+#define CS1550_TRACE_LEVEL TRACE_ERROR
+#endif
 
-		FILE * fp = fopen(".disk", "rb+");
-		fseek(fp, 0, SEEK_SET);
-		fread(root, sizeof(cs1550_root_directory), 1, fp);
-		fprintf(stderr, "RootNum %d\n", root->nDirectories);
-		fclose(fp);
+#define TRACE(level, ...) do { if((level)<=CS1550_TRACE_LEVEL) traceEvent(__VA_ARGS__); } while(0)
 
+#define TRACE_SLOTS 4096
+#define TRACE_MSG 120
 
-	return root;
+struct traceSlot {
+	unsigned long seq;	//sequence number + 1 of the event in here, 0 if empty
+	char msg[TRACE_MSG];
+};
+
+static struct traceSlot traceRing[TRACE_SLOTS];
+static unsigned long traceHead = 0;
+
+//TRACE always expands to the call, so the formats are checked at every level
+static void traceEvent(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void traceEvent(const char *fmt, ...){
+	unsigned long seq = __atomic_fetch_add(&traceHead, 1, __ATOMIC_RELAXED);
+	struct traceSlot *slot = &traceRing[seq % TRACE_SLOTS];
+	va_list ap;
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	va_start(ap, fmt);
+	vsnprintf(slot->msg, TRACE_MSG, fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&slot->seq, seq+1, __ATOMIC_RELEASE);
 }
 
 /*
- *This reads the directory entry at the offset
+ *Writes out the events still in the ring, oldest first. Only uses
+ *write(2), so it is safe to call from a signal handler.
  */
-static cs1550_directory_entry* readDir(long offset){
-		cs1550_directory_entry *dir = (cs1550_directory_entry *)malloc(sizeof(cs1550_directory_entry));
+static void dumpTrace(int fd){
+	unsigned long head = __atomic_load_n(&traceHead, __ATOMIC_ACQUIRE);
+	unsigned long seq = (head>TRACE_SLOTS) ? head-TRACE_SLOTS : 0;
+	for(; seq<head; seq++){
+		struct traceSlot *slot = &traceRing[seq % TRACE_SLOTS];
+		//skip slots that are half written or were lapped while dumping
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)!=seq+1){
+			continue;
+		}
+		write(fd, slot->msg, strnlen(slot->msg, TRACE_MSG));
+		write(fd, "\n", 1);
+	}
+}
 
-		FILE * fp = fopen(".disk", "rb+");
-		fseek(fp, offset, SEEK_SET);
-		fread(dir, sizeof(cs1550_directory_entry), 1, fp);
-		fclose(fp);
-		return dir;
+#ifndef CS1550_NO_MAIN
+static void traceSignal(int sig){
+	(void) sig;
+	dumpTrace(STDERR_FILENO);
 }
+#endif
 
 /*
- *Writes the rootNode to the .disk after update
+ *Statistics, served read-only as STATS_PATH. Every FUSE handler is timed
+ *into a log-linear (HDR style) histogram, 4 buckets per power of two of
+ *nanoseconds, which is enough for percentiles within 25%. The block layer
+ *and allocator count their own events. Everything is updated with
+ *relaxed atomic adds, there is no lock. readdir never lists the file.
  */
-static int writeRoot(cs1550_root_directory * root){
+#define STATS_PATH "/.cs1550_stats"
+#define STATS_BUF 4096
+
+#define HIST_SUB_BITS 2
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+enum {
+	OP_GETATTR,
+	OP_READDIR,
+	OP_MKDIR,
+	OP_MKNOD,
+	OP_READ,
+	OP_WRITE,
+	OP_OPEN,
+	OP_FLUSH,
+	OP_IOCTL,
+	OP_RMDIR,
+	OP_FSYNC,
+	OP_COUNT
+};
+
+static const char *opNames[OP_COUNT] = {
+	"getattr", "readdir", "mkdir", "mknod", "read", "write", "open", "flush", "ioctl", "rmdir", "fsync"
+};
 
+struct opStats {
+	unsigned long calls;
+	unsigned long errors;
+	unsigned long bytes;
+	unsigned long long totalNs;
+	unsigned long long maxNs;
+	unsigned long hist[HIST_BUCKETS];
+};
+
+struct fsStats {
+	struct opStats ops[OP_COUNT];
+	unsigned long diskReads;
+	unsigned long diskWrites;
+	unsigned long diskReadBytes;
+	unsigned long diskWriteBytes;
+	unsigned long relocations;	//files moved by moveFiles
+	unsigned long blocksCopied;	//blocks moved by moveFiles
+	unsigned long allocScans;	//searches of the map for free blocks
+	unsigned long allocScanned;	//map entries looked at by those searches
+	unsigned long defragMoves;	//files slid down by the defragmenter
+	unsigned long defragIdle;	//defragmenter passes that found nothing to do
+	unsigned long compressed;	//files compressed on flush
+	unsigned long compressSaved;	//blocks freed by compressing them
+	unsigned long expanded;		//compressed files expanded for a write
+	unsigned long inflates;		//compressed files decompressed for reads
+	unsigned long deduped;		//files found to be copies on flush
+	unsigned long dedupSaved;	//blocks freed by sharing them
+	unsigned long unshared;		//shared files copied for a write
+	unsigned long checksumBlocks;	//blocks checked against their checksums
+	unsigned long checksumErrors;	//blocks that didn't match
+	unsigned long clonesShared;	//clones that share the original's blocks
+	unsigned long clonesCopied;	//clones copied block by block inside .disk
+	unsigned long snapCopies;	//files copied before a write to the snapshot's blocks
+	unsigned long rmwReads;		//partly written blocks read back from .disk first
+	unsigned long rmwCached;	//partly written blocks that were still in rmwBlock
+	unsigned long holeBlocks;	//blocks skipped by writes past the end, left as holes
+	unsigned long stripeParallel;	//requests split across the backing files' workers
+	unsigned long uringSubmits;	//submissions to an io_uring with -o uring
+	unsigned long uringEntries;	//reads and writes in those submissions
+	unsigned long negHits;		//getattr misses answered from negCache
+	unsigned long placedAway;	//new files that couldn't go where placeFile wanted them
+	unsigned long createBatches;	//directory blocks written for a batch of creates
+	unsigned long batchedCreates;	//files made in those batches
+	unsigned long checkpoints;	//times the image in memory was written out with -o ram
+	unsigned long checkpointBytes;	//bytes those wrote
+};
 
-	FILE * fp = fopen(".disk", "rb+");
-	fseek(fp, 0, SEEK_SET);
-	fwrite(root, sizeof(cs1550_root_directory), 1, fp);
-	fclose(fp);
+static struct fsStats stats;
+//set while the defragmenter is paused, see defragSignal
+static volatile int defragPaused = 0;
 
-	return 1;
+#define STAT_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+
+static unsigned long long nowNs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
 }
 
-/*Writes the directory entry to .disk
- *only called when new dirs are created.
- */
-static int writeDir(long offset){
-	cs1550_directory_entry* newEntry = (cs1550_directory_entry*)malloc(sizeof(cs1550_directory_entry));
-	newEntry->nFiles = 0;
-	FILE * fp = fopen(".disk", "rb+");
-	fseek(fp, offset, SEEK_SET);
-	fwrite(newEntry, sizeof(cs1550_directory_entry), 1, fp);
-	fclose(fp);
-	return 1;
+static int histBucket(unsigned long long ns){
+	int exp;
+	if(ns < (1 << HIST_SUB_BITS)){
+		return (int)ns;
+	}
+	exp = 63 - __builtin_clzll(ns);
+	return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (int)((ns >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+//largest latency that lands in bucket
+static unsigned long long histBucketTop(int bucket){
+	int exp;
+	unsigned long long sub;
+	if(bucket < (1 << HIST_SUB_BITS)){
+		return bucket;
+	}
+	exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+	return (((1ULL << HIST_SUB_BITS) + sub + 1) << (exp - HIST_SUB_BITS)) - 1;
 }
 
 /*
- *Updates the directory entry after new files are created.
+ *Records one finished call of op that started at start (from nowNs).
  */
-static int updateDir(long offset, cs1550_directory_entry * entry){
-	FILE * fp = fopen(".disk", "rb+");
-	fseek(fp, offset, SEEK_SET);
-	fwrite(entry, sizeof(cs1550_directory_entry), 1, fp);
-	fclose(fp);
-	return 1;
+static void recordOp(int op, unsigned long long start, int ret, unsigned long bytes){
+	struct opStats *o = &stats.ops[op];
+	unsigned long long ns = nowNs()-start;
+	unsigned long long max = __atomic_load_n(&o->maxNs, __ATOMIC_RELAXED);
+
+	STAT_ADD(o->calls, 1);
+	if(ret<0){
+		STAT_ADD(o->errors, 1);
+	}
+	STAT_ADD(o->bytes, bytes);
+	STAT_ADD(o->totalNs, ns);
+	STAT_ADD(o->hist[histBucket(ns)], 1);
+	while(ns>max&&!__atomic_compare_exchange_n(&o->maxNs, &max, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+	}
 }
 
 /*
- *Checks if the path contains two slashes(whether is sub dir or /)
+ *Latency in ns that fraction of the calls of o came in under. The call
+ *is placed within its bucket by its rank among the calls in it, and
+ *never above the slowest call seen, so p50 <= p90 <= p99 <= max.
  */
-static int checkAccess(char * path){
+static unsigned long long histPercentile(const struct opStats *o, double fraction){
+	unsigned long target = (unsigned long)(o->calls*fraction);
+	unsigned long seen = 0;
 	int i;
-	int counter = 0;
-	for(i = 0; i<strlen(path); i++){
-		char x = path[i];
-		if(x=='/'){
-			counter++;
-			if(counter>1){
-				return 0;
-			}
+	//rank of the call we want, rounded up
+	if(target<o->calls*fraction||target<1){
+		target++;
+	}
+	for(i = 0; i<HIST_BUCKETS&&o->calls>0; i++){
+		seen += o->hist[i];
+		if(seen>=target){
+			unsigned long long low = i>0 ? histBucketTop(i-1)+1 : 0;
+			unsigned long long ns = low+(histBucketTop(i)-low)*(target-(seen-o->hist[i]))/o->hist[i];
+			return ns<o->maxNs ? ns : o->maxNs;
 		}
 	}
-	return 1;
+	//the copy of the counters was taken while calls were being recorded
+	return o->maxNs;
 }
 
 /*
- *Writes block of data to certain offset.
+ *Formats the stats into out, one "key value" line each, and returns the
+ *length.
  */
-static int writeFile(long offset, cs1550_disk_block * data){
-	FILE * fp = fopen(".disk", "rb+");
-	fseek(fp, offset, SEEK_SET);
-	fwrite(data, sizeof(cs1550_directory_entry), 1, fp);
-	fclose(fp);
-	return 1;
+static int renderStats(char *out, size_t len){
+	int pos = 0;
+	int i;
+
+	for(i = 0; i<OP_COUNT; i++){
+		struct opStats o;
+		memcpy(&o, &stats.ops[i], sizeof(o));
+		pos += snprintf(out+pos, len-pos,
+			"%s calls %lu errors %lu bytes %lu avg_ns %llu p50_ns %llu p90_ns %llu p99_ns %llu max_ns %llu\n",
+			opNames[i], o.calls, o.errors, o.bytes,
+			o.calls ? o.totalNs/o.calls : 0,
+			histPercentile(&o, 0.50),
+			histPercentile(&o, 0.90),
+			histPercentile(&o, 0.99),
+			o.maxNs);
+		if(pos>=(int)len){
+			return len-1;
+		}
+	}
+	pos += snprintf(out+pos, len-pos,
+		"disk reads %lu writes %lu read_bytes %lu write_bytes %lu\n"
+		"relocate files %lu blocks %lu\n"
+		"negative hits %lu\n"
+		"alloc scans %lu scanned %lu placed_away %lu\n"
+		"create batches %lu files %lu\n"
+		"defrag moves %lu idle %lu paused %d\n"
+		"compress files %lu saved_blocks %lu expanded %lu inflates %lu\n"
+		"dedup files %lu saved_blocks %lu unshared %lu\n"
+		"checksum blocks %lu errors %lu\n"
+		"clone shared %lu copied %lu\n"
+		"snapshot copies %lu\n"
+		"rmw reads %lu cached %lu holes %lu\n"
+		"stripe parallel %lu\n"
+		"uring submits %lu entries %lu\n"
+		"checkpoint count %lu bytes %lu\n",
+		stats.diskReads, stats.diskWrites, stats.diskReadBytes, stats.diskWriteBytes,
+		stats.relocations, stats.blocksCopied,
+		stats.negHits,
+		stats.allocScans, stats.allocScanned, stats.placedAway,
+		stats.createBatches, stats.batchedCreates,
+		stats.defragMoves, stats.defragIdle, defragPaused,
+		stats.compressed, stats.compressSaved, stats.expanded, stats.inflates,
+		stats.deduped, stats.dedupSaved, stats.unshared,
+		stats.checksumBlocks, stats.checksumErrors,
+		stats.clonesShared, stats.clonesCopied,
+		stats.snapCopies,
+		stats.rmwReads, stats.rmwCached, stats.holeBlocks,
+		stats.stripeParallel,
+		stats.uringSubmits, stats.uringEntries,
+		stats.checkpoints, stats.checkpointBytes);
+	if(pos>=(int)len){
+		return len-1;
+	}
+	return pos;
 }
 
 /*
- *Looks for a file, and returns the directory entry if it exists.
- *else returns NULL
+ *Options we understand on top of the usual FUSE ones, given with -o.
+ *	disk=A:B:...	the backing files, .disk in the current directory
+ *			if not given; more than one are striped
+ *	stripe=N	blocks in one stripe unit (default 8)
+ *	disk_direct	open the backing files with O_DIRECT, so their blocks
+ *			aren't cached a second time in the host page cache
+ *	uring		do the reads and writes on the backing files through
+ *			io_uring, falling back to pread/pwrite if the kernel
+ *			won't set one up (not with disk_direct)
+ *	ram		keep the whole image in memory and only write it out
+ *			in checkpoints
+ *	checkpoint=N	with ram, checkpoint every N seconds (default 30, 0
+ *			for only on fsync and unmount)
+ *	create_batch=N	write a directory's block once per N files made in
+ *			it in a row, not once per file (default 64, 0 for
+ *			every file)
+ *	defrag		run the background defragmenter
+ *	defrag_rate=N	let it move at most N files a second (default 10)
+ *	small_files	pack new files into shared blocks until they grow
+ *			past SMALL_FILE_MAX bytes
+ *	compress	compress files when they are closed
+ *	dedup		share one copy of files with the same contents
+ *	checksum	keep a CRC32C of every block and check it on reads
+ *	fsck		check the image before mounting it and rebuild the map
+ *			if it doesn't match the directories
  */
-static cs1550_directory_entry* fileExist(char *path){
-	fprintf(stderr, "path from write: %s\n", path);
-	char directory[8];
-	char  filename[8];
-	char extension[3];
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	int i;
-	cs1550_root_directory *root = readRoot();
-	int numOfDirs = root->nDirectories;
-	for(i=0; i<numOfDirs; i++){
-		char *dirName = root->directories[i].dname;
-		if(strcmp(dirName, directory)==0){
-			int startBlock = root->directories[i].nStartBlock;
-			cs1550_directory_entry *dir = readDir(startBlock);
-			int j;
-			for(j=0; j<dir->nFiles; j++){
-			char *file = dir->files[j].fname;
-			if(strcmp(file, filename)==0){
-					return dir;
-			}
-			}
+struct cs1550_config {
+	char *disks;
+	unsigned int stripe;
+	int diskDirect;
+	int uring;
+	int ram;
+	unsigned int checkpoint;
+	unsigned int createBatch;
+	int defrag;
+	unsigned int defragRate;
+	int smallFiles;
+	int compress;
+	int dedup;
+	int checksum;
+	int fsck;
+};
+
+static struct cs1550_config config = {
+	.stripe = 8,
+	.checkpoint = 30,
+	.createBatch = 64,
+	.defragRate = 10,
+};
+
+#ifndef CS1550_NO_MAIN
+#define CS1550_OPT(t, p) { t, offsetof(struct cs1550_config, p), 1 }
+
+static struct fuse_opt cs1550_opts[] = {
+	CS1550_OPT("disk=%s", disks),
+	CS1550_OPT("stripe=%u", stripe),
+	CS1550_OPT("disk_direct", diskDirect),
+	CS1550_OPT("uring", uring),
+	CS1550_OPT("ram", ram),
+	CS1550_OPT("checkpoint=%u", checkpoint),
+	CS1550_OPT("create_batch=%u", createBatch),
+	CS1550_OPT("defrag", defrag),
+	CS1550_OPT("defrag_rate=%u", defragRate),
+	CS1550_OPT("small_files", smallFiles),
+	CS1550_OPT("compress", compress),
+	CS1550_OPT("dedup", dedup),
+	CS1550_OPT("checksum", checksum),
+	CS1550_OPT("fsck", fsck),
+	FUSE_OPT_END
+};
+#endif
+
+/*
+ *Backing files. The image is .disk in the current directory, or the
+ *files given with -o disk=a:b:c, opened once and kept open for the life
+ *of the mount, with pread/pwrite at absolute offsets. With more than one
+ *the image is striped across them RAID0 style: stripe unit n (stripe
+ *blocks of BLOCK_SIZE from offset n*stripe*BLOCK_SIZE) lives on file n %
+ *nDisks, at unit n / nDisks of that file. Everything above diskRead and
+ *diskWrite only ever sees image offsets.
+ */
+#define MAX_DISKS 8
+#define DEFAULT_DISK ".disk"
+
+struct stripeTask;
+
+struct backingFile {
+	char path[PATH_MAX];
+	int fd;
+	off_t size;
+	//unaligned O_DIRECT writes are read-modify-write of whole pages, one at a time
+	pthread_mutex_t directWriteLock;
+	//pieces of striped requests waiting for this file's worker
+	pthread_mutex_t queueLock;
+	pthread_cond_t queued;
+	struct stripeTask *head;
+	struct stripeTask *tail;
+	pthread_t worker;
+};
+
+static struct backingFile disks[MAX_DISKS];
+static int nDisks = 0;
+//bytes in one stripe unit
+static off_t stripeUnit;
+//what the backing files are opened with
+static int diskFlags = O_RDWR;
+//the bitmap is kept in the last sizeof(map) bytes of the image
+static off_t mapOffset;
+static pthread_once_t diskOnce = PTHREAD_ONCE_INIT;
+//the checksums and the snapshot are kept next to the first backing file
+static char crcPath[PATH_MAX + 8];
+static char snapPath[PATH_MAX + 8];
+static char idxPath[PATH_MAX + 8];
+
+/*
+ *Works out the backing files from -o disk and makes their paths
+ *absolute, so nothing depends on the daemon's working directory once
+ *they are known. main calls it before fuse_main changes to /.
+ */
+static void setupDisks(){
+	const char *spec = config.disks!=NULL&&config.disks[0]!='\0' ? config.disks : DEFAULT_DISK;
+	char *copy = strdup(spec);
+	char *save = NULL;
+	char *name;
+
+	if(nDisks>0){
+		free(copy);
+		return;
+	}
+	for(name = strtok_r(copy, ":", &save); name!=NULL; name = strtok_r(NULL, ":", &save)){
+		struct backingFile *d;
+		if(nDisks==MAX_DISKS){
+			fprintf(stderr, "ONLY %d BACKING FILES ARE USED, IGNORING %s\n", MAX_DISKS, name);
+			continue;
+		}
+		d = &disks[nDisks++];
+		if(realpath(name, d->path)==NULL){
+			snprintf(d->path, sizeof(d->path), "%s", name);
 		}
+		d->fd = -1;
+		pthread_mutex_init(&d->directWriteLock, NULL);
+		pthread_mutex_init(&d->queueLock, NULL);
+		pthread_cond_init(&d->queued, NULL);
 	}
-	return NULL;
+	free(copy);
+	if(config.stripe==0){
+		config.stripe = 1;
+	}
+	stripeUnit = (off_t)config.stripe*BLOCK_SIZE;
+	snprintf(crcPath, sizeof(crcPath), "%s.crc", disks[0].path);
+	snprintf(snapPath, sizeof(snapPath), "%s.snap", disks[0].path);
+	snprintf(idxPath, sizeof(idxPath), "%s.idx", disks[0].path);
 }
 
 /*
- *Finds a directory's offset, from the root directory.
+ *pread/pwrite len bytes at offset of fd, carrying on after short
+ *transfers. Reading past the end of the file fills the rest of buf with
+ *zeros.
  */
-static int findOffset(char * directory){
-	int i;
-
-	cs1550_root_directory *root = readRoot();
-	int numOfDirs = root->nDirectories;
-	for(i=0; i<numOfDirs; i++){
-		char *dirName = root->directories[i].dname;
-		if(strcmp(dirName, directory)==0){
-			int startBlock = root->directories[i].nStartBlock;
-			return startBlock;
+static int fullIO(int fd, void *buf, size_t len, off_t offset, int writing){
+	size_t done = 0;
+	while(done<len){
+		ssize_t ret;
+		if(writing){
+			ret = pwrite(fd, (char *)buf+done, len-done, offset+done);
+		}
+		else{
+			ret = pread(fd, (char *)buf+done, len-done, offset+done);
 		}
+		if(ret<0&&errno==EINTR){
+			continue;
+		}
+		if(ret<=0){
+			if(!writing){
+				memset((char *)buf+done, 0, len-done);
+			}
+			return -1;
+		}
+		done += ret;
 	}
-	return -1;
+	return 1;
 }
 
 /*
- * Called whenever the system wants to know the file attributes, including
- * simply whether the file exists or not.
- *
- * man -s 2 stat will show the fields of a stat structure
+ *With O_DIRECT, offsets, lengths and buffers all have to be aligned, so
+ *requests are bounced through aligned buffers. They are kept on a free
+ *list instead of being allocated for every request.
  */
-static int cs1550_getattr(const char *path, struct stat *stbuf)
-{
-
-	int res = 0;
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUF_SIZE (16 * DIRECT_ALIGN)
 
-	memset(stbuf, 0, sizeof(struct stat));
-  //counter for for loops
-	int i = 0;
-	cs1550_root_directory* root;
-	char directory[8];
-	char  filename[8];
-	char extension[3];
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	fprintf(stderr, "Path = %s\n", path);
-	fprintf(stderr, "Direc = %s\n", directory);
-	fprintf(stderr, "Fielname = %s\n",filename);
-	fprintf(stderr, "Extension = %s\n",extension);
-	root = readRoot();
-	int counter = 0;
+struct alignedBuf {
+	struct alignedBuf *next;
+};
 
-	//is path the root dir?
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-		return 0;
-	} else {
-	//return that path doesn't exist if
-	//none of the other conditions under
-	//work
-	res = -ENOENT;
-	//Check if name is subdirectory
-	//go through the array of directories checking for each name
-	for(i = 0; i<MAX_DIRS_IN_ROOT; i++){
-		char *dir_path = root->directories[i].dname;
+static struct alignedBuf *alignedPool = NULL;
+static pthread_mutex_t alignedPoolLock = PTHREAD_MUTEX_INITIALIZER;
 
-		if(strcmp(directory, dir_path)==0){
-			int startBlock = root->directories[i].nStartBlock;
-			cs1550_directory_entry * dir = readDir(startBlock);
-			fprintf(stderr, "FOUND DIR, Files in Dir = %d\n", dir->nFiles);
-				//If there are two slashes in in the path,
-				//and there are no files in the directory
-				//user is probably trying to make a directory in a directory.
-				if(checkAccess(path)==0&&((dir->nFiles)==0)){
-					return -ENOENT;
-				}
-				if(checkAccess(path)==0&&(dir->nFiles)>0){
+static char * getAlignedBuf(){
+	struct alignedBuf *b;
+	void *mem = NULL;
 
-							int j;
-							for(j = 0; j<MAX_FILES_IN_DIR; j++){
-								char *name_path =  dir->files[j].fname;
-								//Check if name is a regular file
+	pthread_mutex_lock(&alignedPoolLock);
+	b = alignedPool;
+	if(b!=NULL){
+		alignedPool = b->next;
+	}
+	pthread_mutex_unlock(&alignedPoolLock);
+	if(b!=NULL){
+		return (char *)b;
+	}
+	if(posix_memalign(&mem, DIRECT_ALIGN, DIRECT_BUF_SIZE)!=0){
+		return NULL;
+	}
+	return (char *)mem;
+}
 
-								if(strcmp(filename, name_path)==0){
-									//regular file, probably want to be read and write
-									stbuf->st_mode = S_IFREG | 0666;
-									stbuf->st_nlink = 1; //file links
-									stbuf->st_size = dir->files[j].fsize; //file size - make sure you replace with real size!
-									fprintf(stderr, "FOUND FILE : %s\n", name_path);
-									return 0;
-								}
+static void putAlignedBuf(char *buf){
+	struct alignedBuf *b = (struct alignedBuf *)buf;
+	pthread_mutex_lock(&alignedPoolLock);
+	b->next = alignedPool;
+	alignedPool = b;
+	pthread_mutex_unlock(&alignedPoolLock);
+}
 
-							}
-							fprintf(stderr, "NOT A FILE\n");
-							return -ENOENT;
-						}
-						else{
-							//Might want to return a structure with these fields
-							stbuf->st_mode = S_IFDIR | 0755;
-							stbuf->st_nlink = 2;
-							return 0;
-						}
-				}
+/*
+ *Does a read or write of any size and offset on an O_DIRECT backing
+ *file, a bounce buffer's worth of aligned pages at a time.
+ */
+static int directIO(struct backingFile *d, void *buf, size_t len, off_t offset, int writing){
+	char *bounce = getAlignedBuf();
+	int ret = 1;
 
+	if(bounce==NULL){
+		return -1;
+	}
+	if(writing){
+		pthread_mutex_lock(&d->directWriteLock);
+	}
+	while(len>0&&ret==1){
+		off_t start = offset & ~((off_t)DIRECT_ALIGN-1);
+		size_t skip = offset-start;
+		size_t chunk = DIRECT_BUF_SIZE-skip;
+		size_t span;
+		if(chunk>len){
+			chunk = len;
 		}
-		fprintf(stderr, "NOT A DIRECTORY\n");
-		return -ENOENT;
+		span = (skip+chunk+DIRECT_ALIGN-1) & ~((size_t)DIRECT_ALIGN-1);
+		//the end of the file inside the span reads as zeros, which a write
+		//can build on, but a read fails on it the way fullIO does
+		errno = 0;
+		if((!writing||skip!=0||chunk!=span)&&fullIO(d->fd, bounce, span, start, 0)!=1&&(!writing||errno!=0)){
+			ret = -1;
+			break;
+		}
+		if(writing){
+			memcpy(bounce+skip, buf, chunk);
+			ret = fullIO(d->fd, bounce, span, start, 1);
+		}
+		else{
+			memcpy(buf, bounce+skip, chunk);
+		}
+		buf = (char *)buf+chunk;
+		offset += chunk;
+		len -= chunk;
 	}
-
+	if(writing){
+		pthread_mutex_unlock(&d->directWriteLock);
+	}
+	putAlignedBuf(bounce);
+	return ret;
 }
 
-
+static int backingIO(struct backingFile *d, void *buf, size_t len, off_t offset, int writing){
+	if(config.diskDirect){
+		return directIO(d, buf, len, offset, writing);
+	}
+	return fullIO(d->fd, buf, len, offset, writing);
+}
 
 /*
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
+ *The pieces of one striped request that land on one backing file, in
+ *order. Consecutive pieces are consecutive stripe units of that file.
  */
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
-{
-	//Since we're building with -Wall (all warnings reported) we need
-	//to "use" every parameter, so let's just cast them to void to
-	//satisfy the compiler
-	(void) offset;
-	(void) fi;
+struct stripePiece {
+	char *buf;
+	size_t len;
+	off_t offset;	//in the backing file
+};
 
-	cs1550_root_directory * root  = readRoot();
-	char directory[9];
+struct stripeWait {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+	int ret;
+};
+
+struct stripeTask {
+	struct stripeTask *next;
+	struct backingFile *disk;
+	struct stripePiece *pieces;
+	int nPieces;
+	int writing;
+	struct stripeWait *wait;
+};
 
-	sscanf(path, "/%[^/]", directory);
+//set while every backing file has a worker, see startStripeWorkers
+static int stripeWorkers = 0;
+static volatile int stripeStop = 0;
 
-	//the filler function allows us to add entries to the listing
-	//read the fuse.h file for a description (in the ../include dir)
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	if (strcmp(path, "/") == 0){
+static int runTask(struct stripeTask *t){
+	int ret = 1;
+	int i;
+	for(i = 0; i<t->nPieces; i++){
+		if(backingIO(t->disk, t->pieces[i].buf, t->pieces[i].len, t->pieces[i].offset, t->writing)!=1){
+			ret = -1;
+		}
+	}
+	return ret;
+}
 
-		if(root->nDirectories>0){
-			int i = 0;
-			//if this was the root directory, and fill with all the sub dirs.
-			for(i = 0; i<root->nDirectories; i++){
-					filler(buf, root->directories[i].dname, NULL, 0);
-				}
-			}
-			return 0;
+static void finishTask(struct stripeTask *t, int ret){
+	struct stripeWait *w = t->wait;
+	pthread_mutex_lock(&w->lock);
+	if(ret!=1){
+		w->ret = ret;
 	}
-	else{
-		int i;
-		for(i=0; i<MAX_DIRS_IN_ROOT; i++){
-			char *dirName = root->directories[i].dname;
-			//if you found the sub dir, fill with all the files in the  sub dir.
-			if(strcmp(dirName, directory)==0){
-					int start = root->directories[i].nStartBlock;
-					cs1550_directory_entry *dir  = readDir(start);
-					if(dir->nFiles>0){
-					for(i = 0; i<dir->nFiles; i++){
-							char name[12];
-							strcpy(name, dir->files[i].fname);
-							fprintf(stderr, "EXTENSION : %s\n", dir->files[i].fext);
-							if(strcmp(dir->files[i].fext,"")!=0){
-								strcat(name, ".");
-								strcat(name, dir->files[i].fext);
-						  }
-							filler(buf, name, NULL, 0);
-						}
-					}
-					return 0;
+	if(--w->pending==0){
+		pthread_cond_signal(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void *stripeWorker(void *arg){
+	struct backingFile *d = (struct backingFile *)arg;
+	for(;;){
+		struct stripeTask *t;
+		pthread_mutex_lock(&d->queueLock);
+		while(d->head==NULL&&!stripeStop){
+			pthread_cond_wait(&d->queued, &d->queueLock);
+		}
+		t = d->head;
+		if(t!=NULL){
+			d->head = t->next;
+			if(d->head==NULL){
+				d->tail = NULL;
 			}
 		}
+		pthread_mutex_unlock(&d->queueLock);
+		if(t==NULL){
+			return NULL;
+		}
+		finishTask(t, runTask(t));
+	}
+}
 
+static void queueTask(struct stripeTask *t){
+	struct backingFile *d = t->disk;
+	t->next = NULL;
+	pthread_mutex_lock(&d->queueLock);
+	if(d->tail!=NULL){
+		d->tail->next = t;
 	}
-	return -ENOENT;
+	else{
+		d->head = t;
+	}
+	d->tail = t;
+	pthread_cond_signal(&d->queued);
+	pthread_mutex_unlock(&d->queueLock);
 }
 
 /*
- * Creates a directory. We can ignore mode since we're not dealing with
- * permissions, as long as getattr returns appropriate ones for us.
+ *io_uring backend, with -o uring. Each request goes to the kernel as one
+ *submission, with an entry for every piece of it on every backing file,
+ *so the pieces of a striped request overlap without the stripe workers.
+ *The rings are set up with the raw syscalls from linux/io_uring.h and
+ *kept on a free list, like the bounce buffers, so requests running at
+ *the same time each get their own. If the kernel won't set one up
+ *everything stays on pread/pwrite. disk_direct keeps to pread/pwrite as
+ *well, since its requests go through the bounce buffers.
  */
-static int cs1550_mkdir(const char *path, mode_t mode)
-{
-	int res;
-	(void) path;
-	(void) mode;
-	char name[9];
+#define URING_ENTRIES 64
+
+struct uring {
+	struct uring *next;
+	int fd;
+	int broken;	//io_uring_enter kept failing, freed instead of reused
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	struct io_uring_sqe *sqes;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	size_t sqesSize;
+};
 
-	int i;
-	int counter = 0;
-	//if this is not being created in root dir
-	//return
+static struct uring *uringPool = NULL;
+static pthread_mutex_t uringPoolLock = PTHREAD_MUTEX_INITIALIZER;
+//set once the kernel has refused to set up a ring
+static int uringFailed = 0;
 
-	if(checkAccess(path)==0){
-		return -EPERM;
+static void freeRing(struct uring *r){
+	if(r->sqes!=MAP_FAILED){
+		munmap(r->sqes, r->sqesSize);
 	}
-
-	//if dir_name too long, return error
-	if((strlen(path)-1)>8){
-		res = -ENAMETOOLONG;
-		return res;
+	if(r->cqRing!=MAP_FAILED){
+		munmap(r->cqRing, r->cqRingSize);
 	}
-	//scan the name of the dir the user wants to create
-	sscanf(path, "/%s", name);
-
-	//read teh root from the .disk file
-	cs1550_root_directory* root = readRoot();
+	if(r->sqRing!=MAP_FAILED){
+		munmap(r->sqRing, r->sqRingSize);
+	}
+	close(r->fd);
+	free(r);
+}
 
-	//get the number of directories already existing
-	int directoryNum = root->nDirectories;
-	int startBlock;
+static struct uring *newRing(){
+	struct io_uring_params p;
+	struct uring *r = (struct uring *)calloc(1, sizeof(struct uring));
 
-	//if the directory already exist.
-	for(i = 0; i<directoryNum; i++){
-		if(strcmp(root->directories[i].dname, name)==0){
-			return -EEXIST;
-		}
+	if(r==NULL){
+		return NULL;
 	}
-	//copy the name of this directory the user wants to create
-	//in the dirName in the root
-	strcpy((root->directories[directoryNum]).dname, name);
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if(r->fd<0){
+		free(r);
+		return NULL;
+	}
+	r->sqRingSize = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	r->cqRingSize = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	r->sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+	r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqRing==MAP_FAILED||r->cqRing==MAP_FAILED||r->sqes==MAP_FAILED){
+		freeRing(r);
+		return NULL;
+	}
+	r->sqTail = (unsigned *)((char *)r->sqRing+p.sq_off.tail);
+	r->sqMask = (unsigned *)((char *)r->sqRing+p.sq_off.ring_mask);
+	r->sqArray = (unsigned *)((char *)r->sqRing+p.sq_off.array);
+	r->cqHead = (unsigned *)((char *)r->cqRing+p.cq_off.head);
+	r->cqTail = (unsigned *)((char *)r->cqRing+p.cq_off.tail);
+	r->cqMask = (unsigned *)((char *)r->cqRing+p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cqRing+p.cq_off.cqes);
+	return r;
+}
+
+/*
+ *A ring for one request, or NULL if requests go through pread/pwrite.
+ *Give it back with putRing.
+ */
+static struct uring *getRing(){
+	struct uring *r;
+
+	if(!config.uring||config.diskDirect||uringFailed){
+		return NULL;
+	}
+	pthread_mutex_lock(&uringPoolLock);
+	r = uringPool;
+	if(r!=NULL){
+		uringPool = r->next;
+	}
+	pthread_mutex_unlock(&uringPoolLock);
+	if(r!=NULL){
+		return r;
+	}
+	r = newRing();
+	if(r==NULL&&!uringFailed){
+		uringFailed = 1;
+		fprintf(stderr, "IO_URING NOT AVAILABLE, USING PREAD/PWRITE\n");
+	}
+	return r;
+}
+
+static void putRing(struct uring *r){
+	if(r==NULL){
+		return;
+	}
+	if(r->broken){
+		freeRing(r);
+		return;
+	}
+	pthread_mutex_lock(&uringPoolLock);
+	r->next = uringPool;
+	uringPool = r;
+	pthread_mutex_unlock(&uringPoolLock);
+}
+
+/*
+ *Closes the rings on the free list. Called at unmount.
+ */
+static void freeRings(){
+	pthread_mutex_lock(&uringPoolLock);
+	while(uringPool!=NULL){
+		struct uring *r = uringPool;
+		uringPool = r->next;
+		freeRing(r);
+	}
+	pthread_mutex_unlock(&uringPoolLock);
+}
+
+//io_uring_enter failures in a row before a ring is given up on
+#define URING_RETRIES 16
+
+/*
+ *Gives up on a ring io_uring_enter keeps failing on, and on io_uring for
+ *the rest of the mount, the same as when the kernel won't set one up.
+ *putRing frees it.
+ */
+static void breakRing(struct uring *r){
+	r->broken = 1;
+	uringFailed = 1;
+	config.uring = 0;
+	fprintf(stderr, "IO_URING FAILING, USING PREAD/PWRITE\n");
+}
+
+/*
+ *Does the pieces in batch that aren't finished with fullIO.
+ */
+static int finishPieces(struct stripePiece **batch, int *fds, const char *finished, int n, int writing){
+	int ret = 1;
+	int i;
+
+	for(i = 0; i<n; i++){
+		if(!finished[i]&&fullIO(fds[i], batch[i]->buf, batch[i]->len, batch[i]->offset, writing)!=1){
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/*
+ *Submits the n pieces in batch, piece i on fds[i], and waits for all of
+ *them. A piece the kernel only did part of, or failed, is finished with
+ *fullIO, which also zero fills reads past the end of a file. If
+ *io_uring_enter fails URING_RETRIES times in a row, the ring is given
+ *up on and the pieces not completed yet are done with fullIO.
+ */
+static int uringBatch(struct uring *r, struct stripePiece **batch, int *fds, int n, int writing){
+	char finished[URING_ENTRIES];
+	unsigned tail = *r->sqTail;
+	int submitted = 0;
+	int completed = 0;
+	int failures = 0;
+	int ret = 1;
+	int i;
+
+	memset(finished, 0, n);
+	if(r->broken){
+		return finishPieces(batch, fds, finished, n, writing);
+	}
+	for(i = 0; i<n; i++){
+		unsigned idx = tail & *r->sqMask;
+		struct io_uring_sqe *sqe = &r->sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = writing ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = fds[i];
+		sqe->addr = (unsigned long)batch[i]->buf;
+		sqe->len = batch[i]->len;
+		sqe->off = batch[i]->offset;
+		sqe->user_data = i;
+		r->sqArray[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(r->sqTail, tail, __ATOMIC_RELEASE);
+	STAT_ADD(stats.uringSubmits, 1);
+	STAT_ADD(stats.uringEntries, n);
+
+	while(completed<n){
+		unsigned head;
+		int got = syscall(__NR_io_uring_enter, r->fd, n-submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(got<0){
+			if(errno==EINTR){
+				continue;
+			}
+			if(errno!=EAGAIN&&errno!=EBUSY&&submitted<n){
+				//the kernel took none of the rest, take them back and do them here
+				__atomic_store_n(r->sqTail, tail-(n-submitted), __ATOMIC_RELEASE);
+				for(i = submitted; i<n; i++){
+					if(fullIO(fds[i], batch[i]->buf, batch[i]->len, batch[i]->offset, writing)!=1){
+						ret = -1;
+					}
+					finished[i] = 1;
+				}
+				completed += n-submitted;
+				submitted = n;
+			}
+			else if(++failures==URING_RETRIES){
+				breakRing(r);
+				return finishPieces(batch, fds, finished, n, writing)==1 ? ret : -1;
+			}
+			continue;
+		}
+		failures = 0;
+		submitted += got;
+		head = *r->cqHead;
+		while(head!=__atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)){
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+			struct stripePiece *piece = batch[cqe->user_data];
+			size_t did = cqe->res>0 ? (size_t)cqe->res : 0;
+			if(did<piece->len&&fullIO(fds[cqe->user_data], piece->buf+did, piece->len-did,
+				piece->offset+did, writing)!=1){
+				ret = -1;
+			}
+			finished[cqe->user_data] = 1;
+			head++;
+			completed++;
+		}
+		__atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+	}
+	return ret;
+}
+
+/*
+ *Runs the pieces of count tasks on ring r, URING_ENTRIES at a time.
+ */
+static int uringRun(struct uring *r, struct stripeTask *tasks, int count){
+	struct stripePiece *batch[URING_ENTRIES];
+	int fds[URING_ENTRIES];
+	int ret = 1;
+	int n = 0;
+	int t;
+	int i;
+
+	for(t = 0; t<count; t++){
+		for(i = 0; i<tasks[t].nPieces; i++){
+			batch[n] = &tasks[t].pieces[i];
+			fds[n] = tasks[t].disk->fd;
+			if(++n==URING_ENTRIES){
+				if(uringBatch(r, batch, fds, n, tasks[t].writing)!=1){
+					ret = -1;
+				}
+				n = 0;
+			}
+		}
+	}
+	if(n>0&&uringBatch(r, batch, fds, n, tasks[0].writing)!=1){
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ *Reads or writes len bytes of the image at offset. A request that
+ *spans more than one backing file is split into a task per file. With
+ *-o uring they all go to the kernel in one submission. Otherwise, with
+ *the workers running they go to them, except the first, which the
+ *caller does itself while they work, so a large request costs about as
+ *long as its share of one file. Without them the tasks run in turn.
+ */
+static int stripedIO(void *buf, size_t len, off_t offset, int writing){
+	struct stripeTask tasks[MAX_DISKS];
+	struct stripePiece *pieces;
+	struct stripeWait wait;
+	struct uring *ring = getRing();
+	int perDisk;
+	int used = 0;
+	int ret = 1;
+	size_t done;
+	int i;
+
+	if(nDisks==1&&ring==NULL){
+		return backingIO(&disks[0], buf, len, offset, writing);
+	}
+	if(nDisks==1){
+		struct stripePiece whole = {(char *)buf, len, offset};
+		tasks[0].disk = &disks[0];
+		tasks[0].pieces = &whole;
+		tasks[0].nPieces = 1;
+		tasks[0].writing = writing;
+		ret = uringRun(ring, tasks, 1);
+		putRing(ring);
+		return ret;
+	}
+	perDisk = len/(stripeUnit*nDisks)+2;
+	pieces = (struct stripePiece *)malloc(nDisks*perDisk*sizeof(struct stripePiece));
+	if(pieces==NULL){
+		putRing(ring);
+		return -1;
+	}
+	for(i = 0; i<nDisks; i++){
+		tasks[i].disk = &disks[i];
+		tasks[i].pieces = pieces+i*perDisk;
+		tasks[i].nPieces = 0;
+		tasks[i].writing = writing;
+		tasks[i].wait = &wait;
+	}
+	for(done = 0; done<len; ){
+		off_t at = offset+done;
+		off_t unit = at/stripeUnit;
+		struct stripeTask *t = &tasks[unit % nDisks];
+		struct stripePiece *p = &t->pieces[t->nPieces++];
+		p->buf = (char *)buf+done;
+		p->len = stripeUnit-at%stripeUnit;
+		if(p->len>len-done){
+			p->len = len-done;
+		}
+		p->offset = unit/nDisks*stripeUnit+at%stripeUnit;
+		done += p->len;
+		if(t->nPieces==1){
+			used++;
+		}
+	}
+
+	if(ring!=NULL){
+		ret = uringRun(ring, tasks, nDisks);
+		putRing(ring);
+	}
+	else if(used>1&&stripeWorkers){
+		struct stripeTask *mine = NULL;
+		pthread_mutex_init(&wait.lock, NULL);
+		pthread_cond_init(&wait.done, NULL);
+		wait.pending = used-1;
+		wait.ret = 1;
+		for(i = 0; i<nDisks; i++){
+			if(tasks[i].nPieces==0){
+				continue;
+			}
+			if(mine==NULL){
+				mine = &tasks[i];
+			}
+			else{
+				queueTask(&tasks[i]);
+			}
+		}
+		ret = runTask(mine);
+		pthread_mutex_lock(&wait.lock);
+		while(wait.pending>0){
+			pthread_cond_wait(&wait.done, &wait.lock);
+		}
+		pthread_mutex_unlock(&wait.lock);
+		if(wait.ret!=1){
+			ret = wait.ret;
+		}
+		pthread_mutex_destroy(&wait.lock);
+		pthread_cond_destroy(&wait.done);
+		STAT_ADD(stats.stripeParallel, 1);
+	}
+	else{
+		for(i = 0; i<nDisks; i++){
+			if(tasks[i].nPieces>0&&runTask(&tasks[i])!=1){
+				ret = -1;
+			}
+		}
+	}
+	free(pieces);
+	return ret;
+}
+
+/*
+ *Stops the first count workers.
+ */
+static void joinStripeWorkers(int count){
+	int i;
+	stripeWorkers = 0;
+	stripeStop = 1;
+	for(i = 0; i<nDisks; i++){
+		pthread_mutex_lock(&disks[i].queueLock);
+		pthread_cond_broadcast(&disks[i].queued);
+		pthread_mutex_unlock(&disks[i].queueLock);
+	}
+	for(i = 0; i<count; i++){
+		pthread_join(disks[i].worker, NULL);
+	}
+}
+
+/*
+ *Starts a worker for every backing file, if there is more than one.
+ */
+static void startStripeWorkers(){
+	int i;
+	//with -o ram only checkpoints write the backing files, a file at a time
+	if(nDisks<2||config.ram){
+		return;
+	}
+	stripeStop = 0;
+	for(i = 0; i<nDisks; i++){
+		if(pthread_create(&disks[i].worker, NULL, stripeWorker, &disks[i])!=0){
+			//run everything on the caller's thread rather than with some workers missing
+			joinStripeWorkers(i);
+			return;
+		}
+	}
+	stripeWorkers = 1;
+}
+
+static void stopStripeWorkers(){
+	if(stripeWorkers){
+		joinStripeWorkers(nDisks);
+	}
+}
+
+/*
+ *RAM-resident image. With -o ram the whole image is read into ramImage
+ *when it is opened, and every read and write after that is a memcpy.
+ *Nothing reaches the backing files until checkpointImage writes the
+ *image out, every checkpoint=N seconds, on fsync and at unmount. What
+ *was written since the last checkpoint is lost if the daemon dies, so
+ *this is for scratch images.
+ */
+static char *ramImage = NULL;
+static off_t ramSize;
+//set by writes, cleared when a checkpoint takes its copy
+static int ramDirty = 0;
+static pthread_mutex_t ramLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void loadRamImage(off_t size){
+	char *image = (char *)malloc(size);
+	if(image==NULL){
+		fprintf(stderr, "CANNOT KEEP %ld BYTES IN MEMORY, USING THE BACKING FILES\n", (long)size);
+		config.ram = 0;
+		return;
+	}
+	stripedIO(image, size, 0, 0);
+	ramSize = size;
+	ramImage = image;
+}
+
+/*
+ *Reads or writes len bytes of the image at offset, in ramImage with -o
+ *ram and in the backing files otherwise. Like fullIO, reading past the
+ *end fills the rest of buf with zeros.
+ */
+static int imageIO(void *buf, size_t len, off_t offset, int writing){
+	size_t inside = len;
+	if(ramImage==NULL){
+		return stripedIO(buf, len, offset, writing);
+	}
+	if(offset>=ramSize){
+		inside = 0;
+	}
+	else if(offset+(off_t)len>ramSize){
+		inside = ramSize-offset;
+	}
+	pthread_mutex_lock(&ramLock);
+	if(writing){
+		memcpy(ramImage+offset, buf, inside);
+		ramDirty = 1;
+	}
+	else{
+		memcpy(buf, ramImage+offset, inside);
+		memset((char *)buf+inside, 0, len-inside);
+	}
+	pthread_mutex_unlock(&ramLock);
+	return inside==len ? 1 : -1;
+}
+
+/*
+ *Checksums. With -o checksum every BLOCK_SIZE block of the image (root,
+ *directories, data and the blocks the map sits in) has a CRC32C, kept in
+ *memory and written through to crcPath, one unsigned int per block.
+ *diskWrite keeps them up to date. readRoot, readDir, readMap and
+ *cs1550_read check the blocks they read against them. The file is
+ *rebuilt from the image if it is missing or the wrong size, and removed
+ *when the image is mounted without the option, since it would go stale.
+ */
+#define CRC32C_POLY 0x82f63b78
+#define CRC_REBUILD_BLOCKS 64
+
+static unsigned int crc32cTable[256];
+static unsigned int *blockCrcs = NULL;
+static long crcBlocks = 0;
+static int crcFd = -1;
+
+static unsigned int crc32cSoft(unsigned int crc, const unsigned char *p, size_t len){
+	while(len--){
+		crc = crc32cTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+//the SSE4.2 crc32 instruction computes CRC32C, 8 bytes at a time
+__attribute__((target("sse4.2")))
+static unsigned int crc32cHw(unsigned int crc, const unsigned char *p, size_t len){
+	unsigned long long c = crc;
+	for(; len>=8; len -= 8, p += 8){
+		unsigned long long v;
+		memcpy(&v, p, sizeof(v));
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	crc = (unsigned int)c;
+	for(; len>0; len--){
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+static unsigned int (*crc32cUpdate)(unsigned int, const unsigned char *, size_t) = crc32cSoft;
+
+static void crc32cInit(){
+	unsigned int i;
+	int k;
+	for(i = 0; i<256; i++){
+		unsigned int crc = i;
+		for(k = 0; k<8; k++){
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32cTable[i] = crc;
+	}
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2")){
+		crc32cUpdate = crc32cHw;
+	}
+#endif
+}
+
+static unsigned int blockCrc(const void *block){
+	return ~crc32cUpdate(~0u, (const unsigned char *)block, BLOCK_SIZE);
+}
+
+/*
+ *Loads the checksums of an image of size bytes, or works them out from
+ *the image if crcPath doesn't have them.
+ */
+static void openChecksums(off_t size){
+	struct stat st;
+
+	crc32cInit();
+	crcBlocks = size/BLOCK_SIZE;
+	blockCrcs = (unsigned int *)calloc(crcBlocks, sizeof(unsigned int));
+	crcFd = open(crcPath, O_RDWR | O_CREAT, 0644);
+	if(crcFd==-1){
+		fprintf(stderr, "CANNOT OPEN %s: %s\n", crcPath, strerror(errno));
+		config.checksum = 0;
+		return;
+	}
+	fstat(crcFd, &st);
+	if(st.st_size==(off_t)(crcBlocks*sizeof(unsigned int))
+		&&pread(crcFd, blockCrcs, st.st_size, 0)==st.st_size){
+		return;
+	}
+
+	char *chunk = (char *)malloc(CRC_REBUILD_BLOCKS*BLOCK_SIZE);
+	long b = 0;
+	while(b<crcBlocks){
+		long n = crcBlocks-b<CRC_REBUILD_BLOCKS ? crcBlocks-b : CRC_REBUILD_BLOCKS;
+		int i;
+		stripedIO(chunk, n*BLOCK_SIZE, b*BLOCK_SIZE, 0);
+		for(i = 0; i<n; i++){
+			blockCrcs[b++] = blockCrc(chunk+(i*BLOCK_SIZE));
+		}
+	}
+	free(chunk);
+	if(ftruncate(crcFd, 0)!=0||pwrite(crcFd, blockCrcs, crcBlocks*sizeof(unsigned int), 0)<0){
+		fprintf(stderr, "CANNOT WRITE %s: %s\n", crcPath, strerror(errno));
+	}
+}
+
+/*
+ *Snapshot. mkdir /.snapshot freezes root, the directory blocks and the
+ *map as they are, and saves them to snapPath. Nothing
+ *else is copied. From then on a block the frozen map has in use is
+ *pinned: it is never allocated again, and a file about to be written in
+ *or into pinned blocks is copied somewhere else first. The frozen tree
+ *can be read under /.snapshot until rmdir /.snapshot drops it. There is
+ *one snapshot at a time.
+ */
+#define SNAP_DIR "/.snapshot"
+
+static int snapTaken = 0;
+static cs1550_root_directory snapRoot;
+static cs1550_directory_entry snapDirs[MAX_DIRS_IN_ROOT];
+static map snapMap;
+
+static int isPinned(int index){
+	return snapTaken&&snapMap.blockmap[index]!=0;
+}
+
+/*
+ *Whether any of the count blocks from index is pinned.
+ */
+static int rangePinned(int index, int count){
+	int i;
+	if(!snapTaken){
+		return 0;
+	}
+	for(i = index; i<index+count&&i<MAX_BLOCK_FOR_FILE; i++){
+		if(snapMap.blockmap[i]!=0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ *Picks up the snapshot saved by an earlier mount, if there is one.
+ */
+static void loadSnapshot(){
+	int fd = open(snapPath, O_RDONLY);
+	if(fd==-1){
+		return;
+	}
+	if(pread(fd, &snapRoot, sizeof(snapRoot), 0)==sizeof(snapRoot)
+		&&pread(fd, snapDirs, sizeof(snapDirs), sizeof(snapRoot))==sizeof(snapDirs)
+		&&pread(fd, &snapMap, sizeof(snapMap), sizeof(snapRoot)+sizeof(snapDirs))==sizeof(snapMap)){
+		snapTaken = 1;
+	}
+	else{
+		fprintf(stderr, "IGNORING SHORT %s\n", snapPath);
+	}
+	close(fd);
+}
+
+/*
+ *Opens every backing file with flags. Returns -1, or the index of the
+ *one that couldn't be opened, with the others closed again and errno
+ *left as that open set it.
+ */
+static int openBacking(int flags){
+	int i;
+	for(i = 0; i<nDisks; i++){
+		disks[i].fd = open(disks[i].path, flags);
+		if(disks[i].fd==-1){
+			int err = errno;
+			int bad = i;
+			while(i-->0){
+				close(disks[i].fd);
+				disks[i].fd = -1;
+			}
+			errno = err;
+			return bad;
+		}
+	}
+	return -1;
+}
+
+static void openDisk(){
+	off_t smallest = -1;
+	off_t size;
+	int flags = O_RDWR;
+	int bad;
+	int i;
+
+	setupDisks();
+	if(config.diskDirect){
+		flags |= O_DIRECT;
+	}
+	bad = openBacking(flags);
+	if(bad!=-1&&config.diskDirect){
+		//not every filesystem a backing file can live on supports O_DIRECT (tmpfs)
+		fprintf(stderr, "O_DIRECT NOT SUPPORTED FOR %s, USING BUFFERED I/O\n", disks[bad].path);
+		config.diskDirect = 0;
+		flags = O_RDWR;
+		bad = openBacking(flags);
+	}
+	if(bad!=-1){
+		fprintf(stderr, "CANNOT OPEN %s: %s\n", disks[bad].path, strerror(errno));
+		return;
+	}
+	diskFlags = flags;
+	for(i = 0; i<nDisks; i++){
+		struct stat st;
+		fstat(disks[i].fd, &st);
+		disks[i].size = st.st_size;
+		if(smallest==-1||st.st_size<smallest){
+			smallest = st.st_size;
+		}
+	}
+	//striped, the image is as many whole stripe units as the smallest file has, from each
+	size = nDisks==1 ? smallest : nDisks*(smallest-smallest%stripeUnit);
+	mapOffset = size - sizeof(map);
+	if(config.ram){
+		loadRamImage(size);
+	}
+	if(config.checksum){
+		openChecksums(size);
+	}
+	else{
+		unlink(crcPath);
+	}
+	loadSnapshot();
+}
+
+/*
+ *Works out the checksums of the blocks that len bytes written from buf at
+ *offset landed in and writes them through to crcPath. Blocks the write
+ *only covered part of are read back whole.
+ */
+static void updateChecksums(const void *buf, size_t len, off_t offset){
+	char block[BLOCK_SIZE];
+	long first = offset/BLOCK_SIZE;
+	long last = (offset+len-1)/BLOCK_SIZE;
+	long b;
+
+	if(len==0){
+		return;
+	}
+	if(last>=crcBlocks){
+		last = crcBlocks-1;
+	}
+	for(b = first; b<=last; b++){
+		off_t at = (off_t)b*BLOCK_SIZE;
+		if(at>=offset&&at+BLOCK_SIZE<=offset+(off_t)len){
+			blockCrcs[b] = blockCrc((const char *)buf+(at-offset));
+			continue;
+		}
+		imageIO(block, BLOCK_SIZE, at, 0);
+		blockCrcs[b] = blockCrc(block);
+	}
+	//with -o ram the checksums go out with the image, in checkpointImage
+	if(first<=last&&ramImage==NULL){
+		pwrite(crcFd, blockCrcs+first, (last-first+1)*sizeof(unsigned int), first*sizeof(unsigned int));
+	}
+}
+
+/*
+ *Checks the blocks len bytes read into buf from offset came from against
+ *their checksums, all in one pass. Blocks the read only covered part of
+ *are read again whole. Returns 0, or -1 if any of them doesn't match.
+ */
+static int verifyBlocks(const void *buf, size_t len, off_t offset){
+	char block[BLOCK_SIZE];
+	long first = offset/BLOCK_SIZE;
+	long last = (offset+len-1)/BLOCK_SIZE;
+	long b;
+
+	if(!config.checksum||len==0){
+		return 0;
+	}
+	if(last>=crcBlocks){
+		last = crcBlocks-1;
+	}
+	for(b = first; b<=last; b++){
+		off_t at = (off_t)b*BLOCK_SIZE;
+		unsigned int crc;
+		if(at>=offset&&at+BLOCK_SIZE<=offset+(off_t)len){
+			crc = blockCrc((const char *)buf+(at-offset));
+		}
+		else{
+			imageIO(block, BLOCK_SIZE, at, 0);
+			crc = blockCrc(block);
+		}
+		if(crc!=blockCrcs[b]){
+			TRACE(TRACE_ERROR, "CHECKSUM MISMATCH IN BLOCK %ld AT %ld", b, (long)at);
+			STAT_ADD(stats.checksumErrors, 1);
+			return -1;
+		}
+	}
+	STAT_ADD(stats.checksumBlocks, last-first+1);
+	return 0;
+}
+
+/*
+ *Copies bytes start to end of from to the same place in to, stopping
+ *early if from is shorter.
+ */
+static int copyRange(int from, int to, off_t start, off_t end){
+	char buf[16 * BLOCK_SIZE];
+	while(start<end){
+		size_t chunk = end-start<(off_t)sizeof(buf) ? (size_t)(end-start) : sizeof(buf);
+		ssize_t got = pread(from, buf, chunk, start);
+		if(got<0&&errno==EINTR){
+			continue;
+		}
+		if(got<0){
+			return -1;
+		}
+		if(got==0){
+			break;
+		}
+		if(fullIO(to, buf, got, start, 1)!=1){
+			return -1;
+		}
+		start += got;
+	}
+	return 1;
+}
+
+/*
+ *Writes len bytes from buf to a temporary file next to path, followed by
+ *what path has after len bytes, up to size, and renames it over path
+ *once it is on disk. *fd, open on path with flags, is moved to the new
+ *file. Nothing else may be using *fd. Returns 0, or -1 with path
+ *untouched.
+ */
+static int replaceFile(const char *path, const void *buf, size_t len, off_t size, int *fd, int flags){
+	char tmp[PATH_MAX + 16];
+	char dir[PATH_MAX + 16];
+	char *slash;
+	int old;
+	int out;
+	int dirFd;
+	int ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(out==-1){
+		return -1;
+	}
+	ok = fullIO(out, (void *)buf, len, 0, 1)==1;
+	//keep the tail the image doesn't cover, *fd may be O_DIRECT so read it through another
+	if(ok&&size>(off_t)len){
+		old = open(path, O_RDONLY);
+		ok = old!=-1&&copyRange(old, out, len, size)==1;
+		if(old!=-1){
+			close(old);
+		}
+	}
+	if(!ok||ftruncate(out, size)!=0||fsync(out)!=0){
+		close(out);
+		unlink(tmp);
+		return -1;
+	}
+	close(out);
+	if(rename(tmp, path)!=0){
+		unlink(tmp);
+		return -1;
+	}
+	//make the rename itself durable
+	snprintf(dir, sizeof(dir), "%s", path);
+	slash = strrchr(dir, '/');
+	if(slash!=NULL){
+		*(slash==dir ? slash+1 : slash) = '\0';
+		dirFd = open(dir, O_RDONLY);
+		if(dirFd!=-1){
+			fsync(dirFd);
+			close(dirFd);
+		}
+	}
+	out = open(path, flags);
+	if(out!=-1){
+		close(*fd);
+		*fd = out;
+	}
+	return 0;
+}
+
+static pthread_mutex_t checkpointLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *Takes a copy of the image and its checksums and writes them out, each
+ *backing file's share of it through part. Caller holds checkpointLock.
+ *With -o ram nothing else touches the backing files once the image is
+ *loaded, and startStripeWorkers doesn't start the stripe workers, so
+ *replaceFile can swap their descriptors.
+ */
+static int writeCheckpoint(char *copy, char *part, off_t partSize, unsigned int *crcs){
+	int ret = 0;
+	int i;
+
+	pthread_mutex_lock(&ramLock);
+	memcpy(copy, ramImage, ramSize);
+	if(crcs!=NULL){
+		memcpy(crcs, blockCrcs, crcBlocks*sizeof(unsigned int));
+	}
+	ramDirty = 0;
+	pthread_mutex_unlock(&ramLock);
+
+	for(i = 0; i<nDisks; i++){
+		if(nDisks>1){
+			off_t unit;
+			for(unit = 0; unit<partSize/stripeUnit; unit++){
+				memcpy(part+unit*stripeUnit, copy+(unit*nDisks+i)*stripeUnit, stripeUnit);
+			}
+		}
+		if(replaceFile(disks[i].path, part, partSize, disks[i].size, &disks[i].fd, diskFlags)!=0){
+			fprintf(stderr, "CANNOT CHECKPOINT %s: %s\n", disks[i].path, strerror(errno));
+			ret = -1;
+		}
+	}
+	if(crcs!=NULL&&replaceFile(crcPath, crcs, crcBlocks*sizeof(unsigned int),
+		crcBlocks*sizeof(unsigned int), &crcFd, O_RDWR)!=0){
+		fprintf(stderr, "CANNOT CHECKPOINT %s: %s\n", crcPath, strerror(errno));
+		ret = -1;
+	}
+	if(ret!=0){
+		//try again next time
+		pthread_mutex_lock(&ramLock);
+		ramDirty = 1;
+		pthread_mutex_unlock(&ramLock);
+		return ret;
+	}
+	STAT_ADD(stats.checkpoints, 1);
+	STAT_ADD(stats.checkpointBytes, ramSize);
+	return 0;
+}
+
+/*
+ *Writes the image in memory out to the backing files. Each one is
+ *replaced whole with replaceFile, so after a crash it holds either the
+ *last checkpoint or this one. Nothing is written if nothing changed
+ *since the last checkpoint. Callers hold fsLock, so the copy is taken
+ *between operations. Returns 0, or -1 if a file couldn't be replaced.
+ */
+static int checkpointImage(){
+	unsigned int *crcs = NULL;
+	char *copy;
+	char *part;
+	off_t partSize = ramSize/nDisks;
+	int dirty;
+	int ret;
+
+	if(ramImage==NULL){
+		return 0;
+	}
+	pthread_mutex_lock(&checkpointLock);
+	pthread_mutex_lock(&ramLock);
+	dirty = ramDirty;
+	pthread_mutex_unlock(&ramLock);
+	if(!dirty){
+		pthread_mutex_unlock(&checkpointLock);
+		return 0;
+	}
+	copy = (char *)malloc(ramSize);
+	part = nDisks==1 ? copy : (char *)malloc(partSize);
+	if(config.checksum){
+		crcs = (unsigned int *)malloc(crcBlocks*sizeof(unsigned int));
+	}
+	if(copy!=NULL&&part!=NULL&&(crcs!=NULL||!config.checksum)){
+		ret = writeCheckpoint(copy, part, partSize, crcs);
+	}
+	else{
+		ret = -1;
+	}
+	if(part!=copy){
+		free(part);
+	}
+	free(copy);
+	free(crcs);
+	pthread_mutex_unlock(&checkpointLock);
+	return ret;
+}
+
+/*
+ *Reads len bytes from .disk at offset into buf.
+ */
+static int diskRead(void *buf, size_t len, off_t offset){
+	pthread_once(&diskOnce, openDisk);
+	STAT_ADD(stats.diskReads, 1);
+	STAT_ADD(stats.diskReadBytes, len);
+	return imageIO(buf, len, offset, 0);
+}
+
+/*
+ *Blocks the write path only partly wrote, so small writes to the end of
+ *a file, or of several files in turn, read the block from .disk once
+ *instead of every time. A block goes in slot (offset / BLOCK_SIZE) %
+ *RMW_SLOTS. Offset 0 is root's block, never a file's, so it marks an
+ *empty slot. diskWrite forgets a block as soon as anything is written
+ *over it.
+ */
+#define RMW_SLOTS 64
+#define RMW_SLOT(offset) ((int)(((offset) / BLOCK_SIZE) % RMW_SLOTS))
+
+static char rmwBlock[RMW_SLOTS][BLOCK_SIZE];
+static off_t rmwOffset[RMW_SLOTS];
+
+static void forgetPatched(off_t offset, size_t len){
+	off_t b;
+
+	if(len==0){
+		return;
+	}
+	if((offset+len-1)/BLOCK_SIZE-offset/BLOCK_SIZE>=RMW_SLOTS){
+		memset(rmwOffset, 0, sizeof(rmwOffset));
+		return;
+	}
+	for(b = offset-(offset%BLOCK_SIZE); b<offset+(off_t)len; b += BLOCK_SIZE){
+		if(rmwOffset[RMW_SLOT(b)]==b){
+			rmwOffset[RMW_SLOT(b)] = 0;
+		}
+	}
+}
+
+/*
+ *Writes len bytes from buf to .disk at offset.
+ */
+static int diskWrite(const void *buf, size_t len, off_t offset){
+	pthread_once(&diskOnce, openDisk);
+	STAT_ADD(stats.diskWrites, 1);
+	STAT_ADD(stats.diskWriteBytes, len);
+	int ret;
+	forgetPatched(offset, len);
+	ret = imageIO((void *)buf, len, offset, 1);
+	if(config.checksum){
+		updateChecksums(buf, len, offset);
+	}
+	return ret;
+}
+
+/*Inode numbers are derived from where an entry lives on disk, so they
+ *stay the same for as long as the entry exists. Root is always 1,
+ *directories follow, then every (directory, file) slot.
+ */
+#define ROOT_INO 1
+#define DIR_INO(dirIndex) (2 + (dirIndex))
+#define FILE_INO(dirIndex, fileIndex) (2 + (MAX_DIRS_IN_ROOT) + ((dirIndex) * (MAX_FILES_IN_DIR)) + (fileIndex))
+#define STATS_INO FILE_INO(MAX_DIRS_IN_ROOT, 0)
+
+//directory blocks sit right after root, in the order they were created
+#define DIR_OFFSET(dirIndex) (BLOCK_SIZE + ((dirIndex) * BLOCK_SIZE))
+
+/*In-memory copies of the root and the directory blocks. They are loaded
+ *the first time they are read and the write helpers below keep them in
+ *sync, so listing a directory and then stat'ing every entry in it only
+ *reads the directory block from .disk once.
+ */
+static cs1550_root_directory rootCache;
+static int rootCached = 0;
+static cs1550_directory_entry dirCache[MAX_DIRS_IN_ROOT];
+static char dirCached[MAX_DIRS_IN_ROOT];
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *Maps a directory block offset to its slot in dirCache, or -1.
+ */
+static int dirCacheIndex(long offset){
+	long index = (offset/BLOCK_SIZE)-1;
+	if(offset%BLOCK_SIZE!=0||index<0||index>=MAX_DIRS_IN_ROOT){
+		return -1;
+	}
+	return (int)index;
+}
+
+/*
+ *The map is kept in memory as well. It is read from .disk once, the
+ *first time it is needed, and checked against its checksums then. Every
+ *lookup after that is served from mapCache, and every change goes to
+ *both, so the read and write paths find out what kind a block is, or
+ *whether it is a hole or free, without going to .disk.
+ */
+static map mapCache;
+static int mapBad = 0;
+static pthread_once_t mapOnce = PTHREAD_ONCE_INIT;
+//no block below it is free in mapCache, so allocation scans start there
+static int freeHint = 0;
+
+/*
+ *Mount index. At a clean unmount root, every directory block and the
+ *map are saved to idxPath, next to the first backing file, with where
+ *the first free block is and the inode, size and mtime the backing files
+ *were left with. The first lookup after the next mount reads it back in
+ *one go and starts with all of the caches above warm. It is removed as
+ *soon as it is read, so there is only ever one after a clean unmount,
+ *and it is ignored if the backing files changed since or it fails the
+ *checksums. Without one a thread started in init warms the caches in
+ *the background while requests are served, see warmThread.
+ */
+#define IDX_MAGIC 0x6373313535306978UL
+
+struct idxHeader {
+	unsigned long magic;
+	long imageSize;
+	int nDisks;
+	int freeHint;
+	struct {
+		unsigned long ino;
+		long size;
+		long mtimeSec;
+		long mtimeNsec;
+	} disks[MAX_DISKS];
+};
+
+struct mountIndex {
+	struct idxHeader h;
+	cs1550_root_directory root;
+	cs1550_directory_entry dirs[MAX_DIRS_IN_ROOT];
+	map blocks;
+};
+
+static int indexLoaded = 0;
+static pthread_once_t indexOnce = PTHREAD_ONCE_INIT;
+
+/*
+ *Fills in the identity of the backing files as they are now.
+ */
+static void stampDisks(struct idxHeader *h){
+	int i;
+	memset(h, 0, sizeof(*h));
+	h->magic = IDX_MAGIC;
+	h->imageSize = mapOffset+sizeof(map);
+	h->nDisks = nDisks;
+	for(i = 0; i<nDisks; i++){
+		struct stat st;
+		fstat(disks[i].fd, &st);
+		h->disks[i].ino = st.st_ino;
+		h->disks[i].size = st.st_size;
+		h->disks[i].mtimeSec = st.st_mtim.tv_sec;
+		h->disks[i].mtimeNsec = st.st_mtim.tv_nsec;
+	}
+}
+
+static int indexMatches(const struct mountIndex *idx){
+	struct idxHeader now;
+	int i;
+
+	stampDisks(&now);
+	now.freeHint = idx->h.freeHint;
+	if(memcmp(&idx->h, &now, sizeof(now))!=0){
+		return 0;
+	}
+	if(verifyBlocks(&idx->root, sizeof(idx->root), 0)!=0
+		||verifyBlocks(&idx->blocks, sizeof(idx->blocks), mapOffset)!=0){
+		return 0;
+	}
+	for(i = 0; i<MAX_DIRS_IN_ROOT; i++){
+		if(verifyBlocks(&idx->dirs[i], sizeof(idx->dirs[i]), DIR_OFFSET(i))!=0){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void loadIndex(){
+	struct mountIndex *idx;
+	ssize_t got;
+	int fd;
+	int i;
+
+	pthread_once(&diskOnce, openDisk);
+	fd = open(idxPath, O_RDONLY);
+	if(fd==-1){
+		return;
+	}
+	idx = (struct mountIndex *)malloc(sizeof(*idx));
+	got = idx!=NULL ? pread(fd, idx, sizeof(*idx), 0) : -1;
+	close(fd);
+	//from here on the image can change under it
+	unlink(idxPath);
+	if(got!=(ssize_t)sizeof(*idx)||!indexMatches(idx)){
+		TRACE(TRACE_INFO, "IGNORING STALE INDEX %s", idxPath);
+		free(idx);
+		return;
+	}
+	pthread_mutex_lock(&cacheLock);
+	memcpy(&rootCache, &idx->root, sizeof(rootCache));
+	rootCached = 1;
+	for(i = 0; i<MAX_DIRS_IN_ROOT; i++){
+		memcpy(&dirCache[i], &idx->dirs[i], sizeof(dirCache[i]));
+		dirCached[i] = 1;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	memcpy(&mapCache, &idx->blocks, sizeof(mapCache));
+	freeHint = idx->h.freeHint;
+	indexLoaded = 1;
+	free(idx);
+}
+
+static void loadMap(){
+	pthread_once(&indexOnce, loadIndex);
+	if(indexLoaded){
+		return;
+	}
+	diskRead(&mapCache, sizeof(map), mapOffset);
+	mapBad = verifyBlocks(&mapCache, sizeof(map), mapOffset)!=0;
+}
+
+/*
+ *The in-memory map, for scans that only look at it. Changes go through
+ *updateMapRange and writeMapRange.
+ */
+static const map *liveMap(){
+	pthread_once(&mapOnce, loadMap);
+	return &mapCache;
+}
+
+/*
+ *Reads the whole bitmap.
+ */
+static int readMap(map *data){
+	memcpy(data, liveMap(), sizeof(map));
+	return mapBad ? -1 : 1;
+}
+
+/*
+ *Create batches. Unpacking an archive or a build makes file after file
+ *in one directory, and each mknod would write that directory's block
+ *and the map byte of the new file. While mknod runs inside a batch,
+ *updateDir leaves the block of batchDir in dirCache and writeMapRange
+ *only widens the span of map bytes to write later. writeBatch writes
+ *the map bytes and then the block once config.createBatch files have
+ *been made, when a file is made in another directory, when anything but
+ *a create changes batchDir, every CREATE_FLUSH_MS ms from createThread,
+ *on fsync and at unmount. Everything else reads through the caches, so
+ *it sees the files at once. A crash loses the files of the open batch,
+ *but nothing on .disk points at blocks the map has free.
+ */
+#define CREATE_FLUSH_MS 50
+
+static pthread_mutex_t batchLock = PTHREAD_MUTEX_INITIALIZER;
+static long batchDir = -1;	//directory block with creates not yet written, or -1
+static int batchCreates = 0;	//files made in it since it was last written
+static int batchCreating = 0;	//set while mknod runs
+static int batchMapLo = -1;	//first and last map byte those changed, or -1
+static int batchMapHi = -1;
+
+/*
+ *Writes out the open batch. Caller holds batchLock.
+ */
+static void writeBatch(){
+	int index = dirCacheIndex(batchDir);
+
+	if(batchMapLo!=-1){
+		diskWrite(mapCache.blockmap+batchMapLo, batchMapHi-batchMapLo+1, mapOffset+batchMapLo);
+		batchMapLo = -1;
+		batchMapHi = -1;
+	}
+	if(index==-1){
+		return;
+	}
+	pthread_mutex_lock(&cacheLock);
+	diskWrite(&dirCache[index], sizeof(cs1550_directory_entry), batchDir);
+	pthread_mutex_unlock(&cacheLock);
+	STAT_ADD(stats.createBatches, 1);
+	STAT_ADD(stats.batchedCreates, batchCreates);
+	batchDir = -1;
+	batchCreates = 0;
+}
+
+/*
+ *Writes out the open batch. Writing it changes the image under readers
+ *(and the checksums they check it against), so callers hold fsLock for
+ *writing.
+ */
+static void flushCreates(){
+	pthread_mutex_lock(&batchLock);
+	writeBatch();
+	pthread_mutex_unlock(&batchLock);
+}
+
+/*
+ *Whether a batch is waiting to be written out.
+ */
+static int batchPending(){
+	int pending;
+
+	pthread_mutex_lock(&batchLock);
+	pending = batchDir!=-1;
+	pthread_mutex_unlock(&batchLock);
+	return pending;
+}
+
+/*
+ *Called by mknod before it makes a file in the directory at dirOff. The
+ *batch of another directory is written out first.
+ */
+static void openBatch(long dirOff){
+	if(config.createBatch==0||dirCacheIndex(dirOff)==-1){
+		return;
+	}
+	pthread_mutex_lock(&batchLock);
+	if(batchDir!=dirOff){
+		writeBatch();
+		batchDir = dirOff;
+	}
+	batchCreating = 1;
+	pthread_mutex_unlock(&batchLock);
+}
+
+/*
+ *Called by mknod when it's done, made saying whether it made the file.
+ */
+static void closeBatch(int made){
+	pthread_mutex_lock(&batchLock);
+	batchCreating = 0;
+	if(made&&batchDir!=-1&&++batchCreates>=(int)config.createBatch){
+		writeBatch();
+	}
+	pthread_mutex_unlock(&batchLock);
+}
+
+/*This method opens the .disk file, and reads
+ *in a the root block and returns it.
+ */
+static cs1550_root_directory* readRoot(){
+
+		cs1550_root_directory* root = (cs1550_root_directory *)malloc(sizeof(cs1550_root_directory));
+
+		pthread_once(&indexOnce, loadIndex);
+		pthread_mutex_lock(&cacheLock);
+		if(!rootCached){
+			diskRead(&rootCache, sizeof(cs1550_root_directory), 0);
+			TRACE(TRACE_DEBUG, "RootNum %d", rootCache.nDirectories);
+			//a root that fails its checksum isn't kept, it's read again next time
+			rootCached = verifyBlocks(&rootCache, sizeof(cs1550_root_directory), 0)==0;
+		}
+		memcpy(root, &rootCache, sizeof(cs1550_root_directory));
+		pthread_mutex_unlock(&cacheLock);
+
+	return root;
+}
+
+/*
+ *This reads the directory entry at the offset
+ */
+static cs1550_directory_entry* readDir(long offset){
+		cs1550_directory_entry *dir = (cs1550_directory_entry *)malloc(sizeof(cs1550_directory_entry));
+		int index = dirCacheIndex(offset);
+
+		pthread_once(&indexOnce, loadIndex);
+		pthread_mutex_lock(&cacheLock);
+		if(index!=-1&&dirCached[index]){
+			memcpy(dir, &dirCache[index], sizeof(cs1550_directory_entry));
+			pthread_mutex_unlock(&cacheLock);
+			return dir;
+		}
+		diskRead(dir, sizeof(cs1550_directory_entry), offset);
+		if(index!=-1&&verifyBlocks(dir, sizeof(cs1550_directory_entry), offset)==0){
+			memcpy(&dirCache[index], dir, sizeof(cs1550_directory_entry));
+			dirCached[index] = 1;
+		}
+		pthread_mutex_unlock(&cacheLock);
+		return dir;
+}
+
+/*
+ *Writes the rootNode to the .disk after update
+ */
+static int writeRoot(cs1550_root_directory * root){
+
+	pthread_mutex_lock(&cacheLock);
+	diskWrite(root, sizeof(cs1550_root_directory), 0);
+	memcpy(&rootCache, root, sizeof(cs1550_root_directory));
+	rootCached = 1;
+	pthread_mutex_unlock(&cacheLock);
+
+	return 1;
+}
+
+/*
+ *Updates the directory entry after new files are created.
+ */
+static int updateDir(long offset, cs1550_directory_entry * entry){
+	int index = dirCacheIndex(offset);
+
+	pthread_mutex_lock(&batchLock);
+	pthread_mutex_lock(&cacheLock);
+	if(offset!=batchDir){
+		diskWrite(entry, sizeof(cs1550_directory_entry), offset);
+	}
+	if(index!=-1){
+		memcpy(&dirCache[index], entry, sizeof(cs1550_directory_entry));
+		dirCached[index] = 1;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	//only creates are held back, any other change writes the batch out
+	if(offset==batchDir&&!batchCreating){
+		writeBatch();
+	}
+	pthread_mutex_unlock(&batchLock);
+	return 1;
+}
+
+/*Writes the directory entry to .disk
+ *only called when new dirs are created.
+ */
+static int writeDir(long offset){
+	cs1550_directory_entry* newEntry = (cs1550_directory_entry*)calloc(1, sizeof(cs1550_directory_entry));
+	newEntry->nFiles = 0;
+	updateDir(offset, newEntry);
+	free(newEntry);
+	return 1;
+}
+
+/*
+ *Fills in the attributes of a directory. dirIndex is the slot in root,
+ *or -1 for root itself.
+ */
+static void fillDirStat(struct stat *stbuf, int dirIndex){
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mode = S_IFDIR | 0755;
+	stbuf->st_nlink = 2;
+	if(dirIndex==-1){
+		stbuf->st_ino = ROOT_INO;
+	}
+	else{
+		stbuf->st_ino = DIR_INO(dirIndex);
+	}
+}
+
+/*
+ *Fills in the attributes of a file from its directory entry.
+ */
+static void fillFileStat(struct stat *stbuf, int dirIndex, int fileIndex, size_t fsize){
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mode = S_IFREG | 0666;
+	stbuf->st_nlink = 1;
+	stbuf->st_size = fsize;
+	stbuf->st_blocks = (fsize+BLOCK_SIZE-1)/BLOCK_SIZE;
+	stbuf->st_ino = FILE_INO(dirIndex, fileIndex);
+}
+
+/*
+ *Checks if the path contains two slashes(whether is sub dir or /)
+ */
+static int checkAccess(char * path){
+	int i;
+	int counter = 0;
+	for(i = 0; i<strlen(path); i++){
+		char x = path[i];
+		if(x=='/'){
+			counter++;
+			if(counter>1){
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+ *Writes block of data to certain offset.
+ */
+static int writeFile(long offset, cs1550_disk_block * data){
+	diskWrite(data, sizeof(cs1550_directory_entry), offset);
+	return 1;
+}
+
+/*
+ *Splits /directory/filename.extension into its parts. Every buffer gets
+ *one character more than a valid name needs, so callers can tell a name
+ *that is too long apart from one that just fits.
+ */
+#define NAME_BUF (MAX_FILENAME + 2)
+#define EXT_BUF (MAX_EXTENSION + 2)
+
+static void splitPath(const char *path, char *directory, char *filename, char *extension){
+	directory[0] = '\0';
+	filename[0] = '\0';
+	extension[0] = '\0';
+	sscanf(path, "/%9[^/]/%9[^.].%4s", directory, filename, extension);
+}
+
+/*
+ *Looks a file up by path and reports which directory slot and file slot
+ *it lives in.
+ */
+static int resolveFile(const char *path, int *dirIndex, int *fileIndex){
+	char directory[NAME_BUF];
+	char filename[NAME_BUF];
+	char extension[EXT_BUF];
+	int i;
+	int j;
+
+	if(checkAccess((char *)path)!=0){
+		return -EISDIR;
+	}
+	splitPath(path, directory, filename, extension);
+	cs1550_root_directory *root = readRoot();
+	for(i=0; i<root->nDirectories; i++){
+		if(strcmp(root->directories[i].dname, directory)==0){
+			cs1550_directory_entry *dir = readDir(root->directories[i].nStartBlock);
+			for(j=0; j<dir->nFiles; j++){
+				if(strcmp(dir->files[j].fname, filename)==0){
+					*dirIndex = i;
+					*fileIndex = j;
+					free(dir);
+					free(root);
+					return 0;
+				}
+			}
+			free(dir);
+		}
+	}
+	free(root);
+	return -ENOENT;
+}
+
+/*
+ *open keeps the slots of the file in fh, so read and write go straight to
+ *the directory block without resolving the path again: the file slot in
+ *the low 16 bits, the dir slot + 1 above it (so 0 means nothing was
+ *stored) and the slot's generation in the high half. Whatever gives a
+ *slot to another file bumps its generation with bumpSlot. Only mknod
+ *does today, since unlink and rmdir don't delete anything and there is
+ *no rename; an unlink, rename or move that frees or shifts slots has to
+ *bump every slot it touches. fileSlots compares the generation in the
+ *handle with the slot's, so a stale handle falls back to the path
+ *instead of pointing at another file.
+ */
+#define FH_MAKE(dirIndex, fileIndex, gen) (((uint64_t)(gen) << 32) | (((uint64_t)(dirIndex) + 1) << 16) | (uint64_t)(fileIndex))
+#define FH_DIR(fh) ((int)(((fh) >> 16) & 0xffff) - 1)
+#define FH_FILE(fh) ((int)((fh) & 0xffff))
+#define FH_GEN(fh) ((unsigned)((fh) >> 32))
+
+//generation of every file slot, under cacheLock
+static unsigned slotGen[MAX_DIRS_IN_ROOT][MAX_FILES_IN_DIR];
+
+static unsigned slotGeneration(int dirIndex, int fileIndex){
+	unsigned gen;
+
+	pthread_mutex_lock(&cacheLock);
+	gen = slotGen[dirIndex][fileIndex];
+	pthread_mutex_unlock(&cacheLock);
+	return gen;
+}
+
+/*
+ *Invalidates the handles open on file slot fileIndex of directory slot
+ *dirIndex.
+ */
+static void bumpSlot(int dirIndex, int fileIndex){
+	pthread_mutex_lock(&cacheLock);
+	slotGen[dirIndex][fileIndex]++;
+	pthread_mutex_unlock(&cacheLock);
+}
+
+/*
+ *Gets the slots of an open file from its handle, or looks the path up
+ *if open didn't fill one in or the slot has changed hands since.
+ */
+static int fileSlots(const char *path, struct fuse_file_info *fi, int *dirIndex, int *fileIndex){
+	if(fi!=NULL&&fi->fh!=0&&slotGeneration(FH_DIR(fi->fh), FH_FILE(fi->fh))==FH_GEN(fi->fh)){
+		*dirIndex = FH_DIR(fi->fh);
+		*fileIndex = FH_FILE(fi->fh);
+		return 0;
+	}
+	return resolveFile(path, dirIndex, fileIndex);
+}
+
+/*
+ *Finds a directory's offset, from the root directory.
+ */
+static int findOffset(char * directory){
+	int i;
+
+	cs1550_root_directory *root = readRoot();
+	int numOfDirs = root->nDirectories;
+	for(i=0; i<numOfDirs; i++){
+		char *dirName = root->directories[i].dname;
+		if(strcmp(dirName, directory)==0){
+			int startBlock = root->directories[i].nStartBlock;
+			return startBlock;
+		}
+	}
+	return -1;
+}
+
+/*
+ *Freezes the tree as it is now. Only metadata is saved, the data blocks
+ *stay where they are and are pinned from here on.
+ */
+static int takeSnapshot(){
+	cs1550_root_directory *root;
+	int fd;
+	int i;
+
+	if(snapTaken){
+		return -EEXIST;
+	}
+	root = readRoot();
+	memcpy(&snapRoot, root, sizeof(snapRoot));
+	memset(snapDirs, 0, sizeof(snapDirs));
+	for(i = 0; i<root->nDirectories; i++){
+		cs1550_directory_entry *dir = readDir(DIR_OFFSET(i));
+		memcpy(&snapDirs[i], dir, sizeof(snapDirs[i]));
+		free(dir);
+	}
+	free(root);
+	readMap(&snapMap);
+
+	fd = open(snapPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd==-1){
+		return -errno;
+	}
+	if(write(fd, &snapRoot, sizeof(snapRoot))!=sizeof(snapRoot)
+		||write(fd, snapDirs, sizeof(snapDirs))!=sizeof(snapDirs)
+		||write(fd, &snapMap, sizeof(snapMap))!=sizeof(snapMap)
+		||fsync(fd)!=0){
+		close(fd);
+		unlink(snapPath);
+		return -EIO;
+	}
+	close(fd);
+	snapTaken = 1;
+	return 0;
+}
+
+/*
+ *Forgets the snapshot. Blocks only it was holding are free again, since
+ *the live map never had them.
+ */
+static int dropSnapshot(){
+	if(!snapTaken){
+		return -ENOENT;
+	}
+	unlink(snapPath);
+	snapTaken = 0;
+	return 0;
+}
+
+/*
+ *Whether path is /.snapshot or something under it.
+ */
+static int isSnapPath(const char *path){
+	size_t len = strlen(SNAP_DIR);
+	return strncmp(path, SNAP_DIR, len)==0&&(path[len]=='\0'||path[len]=='/');
+}
+
+//the frozen tree gets its own inode numbers, after the stats file
+#define SNAP_INO(ino) (STATS_INO + (ino))
+
+/*
+ *Looks rel (a path under /.snapshot) up in the frozen tree. fileIndex is
+ *-1 for a directory, dirIndex is -1 for /.snapshot itself.
+ */
+static int snapResolve(const char *rel, int *dirIndex, int *fileIndex){
+	char directory[NAME_BUF];
+	char filename[NAME_BUF];
+	char extension[EXT_BUF];
+	int i;
+	int j;
+
+	*dirIndex = -1;
+	*fileIndex = -1;
+	if(!snapTaken){
+		return -ENOENT;
+	}
+	if(rel[0]=='\0'||strcmp(rel, "/")==0){
+		return 0;
+	}
+	splitPath(rel, directory, filename, extension);
+	for(i = 0; i<snapRoot.nDirectories; i++){
+		if(strcmp(snapRoot.directories[i].dname, directory)==0){
+			break;
+		}
+	}
+	if(i==snapRoot.nDirectories){
+		return -ENOENT;
+	}
+	*dirIndex = i;
+	if(filename[0]=='\0'){
+		return 0;
+	}
+	for(j = 0; j<MAX_FILES_IN_DIR; j++){
+		if(strcmp(snapDirs[i].files[j].fname, filename)==0
+			&&strcmp(snapDirs[i].files[j].fext, extension)==0){
+			*fileIndex = j;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+/*
+ *getattr for paths under /.snapshot. Nothing in there can be written.
+ */
+static int snapGetattr(const char *rel, struct stat *stbuf){
+	int dirIndex;
+	int fileIndex;
+	int ret = snapResolve(rel, &dirIndex, &fileIndex);
+
+	if(ret!=0){
+		return ret;
+	}
+	if(fileIndex==-1){
+		fillDirStat(stbuf, dirIndex);
+		stbuf->st_ino = SNAP_INO(stbuf->st_ino);
+	}
+	else{
+		fillFileStat(stbuf, dirIndex, fileIndex, snapDirs[dirIndex].files[fileIndex].fsize);
+		stbuf->st_ino = SNAP_INO(stbuf->st_ino);
+	}
+	stbuf->st_mode &= ~0222;
+	return 0;
+}
+
+/*
+ *readdir for paths under /.snapshot, the same way cs1550_readdir lists
+ *the live tree.
+ */
+static int snapReaddir(const char *rel, void *buf, fuse_fill_dir_t filler, off_t offset){
+	char name[13];
+	struct stat st;
+	int dirIndex;
+	int fileIndex;
+	int nEntries;
+	int i;
+	int ret = snapResolve(rel, &dirIndex, &fileIndex);
+
+	if(ret!=0){
+		return ret;
+	}
+	if(fileIndex!=-1){
+		return -ENOTDIR;
+	}
+	nEntries = (dirIndex==-1) ? snapRoot.nDirectories : snapDirs[dirIndex].nFiles;
+	for(i = (offset>0) ? offset : 0; i<nEntries+2; i++){
+		if(i==0){
+			strcpy(name, ".");
+			fillDirStat(&st, dirIndex);
+		}
+		else if(i==1){
+			strcpy(name, "..");
+			fillDirStat(&st, -1);
+		}
+		else if(dirIndex==-1){
+			strcpy(name, snapRoot.directories[i-2].dname);
+			fillDirStat(&st, i-2);
+		}
+		else{
+			struct cs1550_file_directory *file = &snapDirs[dirIndex].files[i-2];
+			strcpy(name, file->fname);
+			if(strcmp(file->fext, "")!=0){
+				strcat(name, ".");
+				strcat(name, file->fext);
+			}
+			fillFileStat(&st, dirIndex, i-2, file->fsize);
+		}
+		st.st_ino = SNAP_INO(st.st_ino);
+		st.st_mode &= ~0222;
+		if(filler(buf, name, &st, i+1)){
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ *Negative lookups. Paths getattr found don't exist are remembered, so
+ *probing for them again, which shells, editors and git do a lot of, is
+ *answered without going through root and the directory block. A path
+ *goes in slot hash(directory, filename) % NEG_SLOTS. The extension is
+ *left out because getattr matches files on the name alone, so every path
+ *a create could bring into existence shares the slot negForget clears.
+ *mknod and mkdir call it, and clones go through mknod. Removing things
+ *never makes a remembered miss wrong.
+ */
+#define NEG_SLOTS 1024
+#define NEG_PATH 32
+
+static char negCache[NEG_SLOTS][NEG_PATH];
+static pthread_mutex_t negLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int negSlot(const char *directory, const char *filename){
+	unsigned int h = 2166136261u;
+	const char *p;
+	for(p = directory; *p; p++){
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	}
+	h = (h ^ '/') * 16777619u;
+	for(p = filename; *p; p++){
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	}
+	return h % NEG_SLOTS;
+}
+
+static int negLookup(const char *path, const char *directory, const char *filename){
+	int slot = negSlot(directory, filename);
+	int hit;
+	pthread_mutex_lock(&negLock);
+	hit = strcmp(negCache[slot], path)==0;
+	pthread_mutex_unlock(&negLock);
+	return hit;
+}
+
+/*
+ *Remembers that path doesn't exist and returns -ENOENT.
+ */
+static int negMiss(const char *path, const char *directory, const char *filename){
+	if(strlen(path)<NEG_PATH){
+		int slot = negSlot(directory, filename);
+		pthread_mutex_lock(&negLock);
+		strcpy(negCache[slot], path);
+		pthread_mutex_unlock(&negLock);
+	}
+	return -ENOENT;
+}
+
+/*
+ *Forgets every remembered miss creating path could make wrong.
+ */
+static void negForget(const char *path){
+	char directory[NAME_BUF];
+	char filename[NAME_BUF];
+	char extension[EXT_BUF];
+	splitPath(path, directory, filename, extension);
+	pthread_mutex_lock(&negLock);
+	negCache[negSlot(directory, filename)][0] = '\0';
+	pthread_mutex_unlock(&negLock);
+}
+
+/*
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not.
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+static int cs1550_getattr(const char *path, struct stat *stbuf)
+{
+
+	int res = 0;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	//the stats file changes all the time, so it has no size and is read
+	//with direct_io (see cs1550_open)
+	if(strcmp(path, STATS_PATH)==0){
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_ino = STATS_INO;
+		return 0;
+	}
+	if(isSnapPath(path)){
+		return snapGetattr(path+strlen(SNAP_DIR), stbuf);
+	}
+  //counter for for loops
+	int i = 0;
+	cs1550_root_directory* root;
+	char directory[NAME_BUF];
+	char  filename[NAME_BUF];
+	char extension[EXT_BUF];
+	splitPath(path, directory, filename, extension);
+	TRACE(TRACE_DEBUG, "Path = %s", path);
+	TRACE(TRACE_DEBUG, "Direc = %s", directory);
+	TRACE(TRACE_DEBUG, "Fielname = %s",filename);
+	TRACE(TRACE_DEBUG, "Extension = %s",extension);
+	if(negLookup(path, directory, filename)){
+		STAT_ADD(stats.negHits, 1);
+		return -ENOENT;
+	}
+	root = readRoot();
+	int counter = 0;
+
+	//is path the root dir?
+	if (strcmp(path, "/") == 0) {
+		fillDirStat(stbuf, -1);
+		return 0;
+	} else {
+	//return that path doesn't exist if
+	//none of the other conditions under
+	//work
+	res = -ENOENT;
+	//Check if name is subdirectory
+	//go through the array of directories checking for each name
+	for(i = 0; i<MAX_DIRS_IN_ROOT; i++){
+		char *dir_path = root->directories[i].dname;
+
+		if(strcmp(directory, dir_path)==0){
+			int startBlock = root->directories[i].nStartBlock;
+			cs1550_directory_entry * dir = readDir(startBlock);
+			TRACE(TRACE_DEBUG, "FOUND DIR, Files in Dir = %d", dir->nFiles);
+				//If there are two slashes in in the path,
+				//and there are no files in the directory
+				//user is probably trying to make a directory in a directory.
+				if(checkAccess(path)==0&&((dir->nFiles)==0)){
+					return negMiss(path, directory, filename);
+				}
+				if(checkAccess(path)==0&&(dir->nFiles)>0){
+
+							int j;
+							for(j = 0; j<MAX_FILES_IN_DIR; j++){
+								char *name_path =  dir->files[j].fname;
+								//Check if name is a regular file
+
+								if(strcmp(filename, name_path)==0){
+									//regular file, probably want to be read and write
+									fillFileStat(stbuf, i, j, dir->files[j].fsize);
+									TRACE(TRACE_DEBUG, "FOUND FILE : %s", name_path);
+									return 0;
+								}
+
+							}
+							TRACE(TRACE_DEBUG, "NOT A FILE");
+							return negMiss(path, directory, filename);
+						}
+						else{
+							//Might want to return a structure with these fields
+							fillDirStat(stbuf, i);
+							return 0;
+						}
+				}
+
+		}
+		TRACE(TRACE_DEBUG, "NOT A DIRECTORY");
+		return negMiss(path, directory, filename);
+	}
+
+}
+
+
+
+/*
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ */
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	//Since we're building with -Wall (all warnings reported) we need
+	//to "use" every parameter, so let's just cast them to void to
+	//satisfy the compiler
+	(void) fi;
+
+	cs1550_root_directory * root  = readRoot();
+	cs1550_directory_entry *dir = NULL;
+	char directory[NAME_BUF] = "";
+	char name[13];
+	struct stat st;
+	int dirIndex = -1;
+	int nEntries;
+	int extra = 0;
+	int i;
+
+	if(isSnapPath(path)){
+		free(root);
+		return snapReaddir(path+strlen(SNAP_DIR), buf, filler, offset);
+	}
+	sscanf(path, "/%9[^/]", directory);
+
+	if (strcmp(path, "/") != 0){
+		for(i=0; i<root->nDirectories; i++){
+			if(strcmp(root->directories[i].dname, directory)==0){
+				dirIndex = i;
+				break;
+			}
+		}
+		if(dirIndex==-1){
+			free(root);
+			return -ENOENT;
+		}
+		dir = readDir(root->directories[dirIndex].nStartBlock);
+		nEntries = dir->nFiles;
+	}
+	else{
+		nEntries = root->nDirectories;
+		//the snapshot shows up as one more directory in root
+		extra = snapTaken;
+	}
+
+	//Entry 0 is ".", 1 is ".." and the rest are the children. The offset we
+	//give filler is the index of the next entry, so a listing that doesn't
+	//fit in one buffer is picked up again from there. Attributes come from
+	//the block we already have in hand instead of a getattr per entry.
+	for(i = (offset>0) ? offset : 0; i<nEntries+2+extra; i++){
+		if(i==0){
+			strcpy(name, ".");
+			fillDirStat(&st, dirIndex);
+		}
+		else if(i==1){
+			strcpy(name, "..");
+			fillDirStat(&st, -1);
+		}
+		else if(dir==NULL&&i-2==nEntries){
+			strcpy(name, SNAP_DIR+1);
+			fillDirStat(&st, -1);
+			st.st_ino = SNAP_INO(ROOT_INO);
+			st.st_mode &= ~0222;
+		}
+		else if(dir==NULL){
+			strcpy(name, root->directories[i-2].dname);
+			fillDirStat(&st, i-2);
+		}
+		else{
+			strcpy(name, dir->files[i-2].fname);
+			if(strcmp(dir->files[i-2].fext,"")!=0){
+				strcat(name, ".");
+				strcat(name, dir->files[i-2].fext);
+			}
+			fillFileStat(&st, dirIndex, i-2, dir->files[i-2].fsize);
+		}
+		//the filler function allows us to add entries to the listing
+		//read the fuse.h file for a description (in the ../include dir)
+		if(filler(buf, name, &st, i+1)){
+			break;
+		}
+	}
+
+	free(dir);
+	free(root);
+	return 0;
+}
+
+/*
+ * Creates a directory. We can ignore mode since we're not dealing with
+ * permissions, as long as getattr returns appropriate ones for us.
+ */
+static int cs1550_mkdir(const char *path, mode_t mode)
+{
+	int res;
+	(void) path;
+	(void) mode;
+	char name[9];
+
+	int i;
+	int counter = 0;
+	if(strcmp(path, SNAP_DIR)==0){
+		return takeSnapshot();
+	}
+	if(isSnapPath(path)){
+		return -EROFS;
+	}
+	negForget(path);
+	//if this is not being created in root dir
+	//return
+
+	if(checkAccess(path)==0){
+		return -EPERM;
+	}
+
+	//if dir_name too long, return error
+	if((strlen(path)-1)>8){
+		res = -ENAMETOOLONG;
+		return res;
+	}
+	//scan the name of the dir the user wants to create
+	sscanf(path, "/%s", name);
+
+	//read teh root from the .disk file
+	cs1550_root_directory* root = readRoot();
+
+	//get the number of directories already existing
+	int directoryNum = root->nDirectories;
+	int startBlock;
+
+	//if the directory already exist.
+	for(i = 0; i<directoryNum; i++){
+		if(strcmp(root->directories[i].dname, name)==0){
+			return -EEXIST;
+		}
+	}
+	//copy the name of this directory the user wants to create
+	//in the dirName in the root
+	strcpy((root->directories[directoryNum]).dname, name);
 
 	//get the directories start BLOCK_SIZE
 	//by adding the root block and all the blocks already created.
-	(root->directories[directoryNum]).nStartBlock = BLOCK_SIZE+(directoryNum*BLOCK_SIZE);
+	(root->directories[directoryNum]).nStartBlock = DIR_OFFSET(directoryNum);
+
+	//save the start block
+	startBlock = DIR_OFFSET(directoryNum);
+	//add one to the number of directoreis
+	root->nDirectories = root->nDirectories+1;
+	//write the root back to disk, and directory entry to disk
+	writeRoot(root);
+	writeDir(startBlock);
+	return 0;
+}
+
+/*
+ * Removes a directory.
+ */
+static int cs1550_rmdir(const char *path)
+{
+	if(strcmp(path, SNAP_DIR)==0){
+		return dropSnapshot();
+	}
+	if(isSnapPath(path)){
+		return -EROFS;
+	}
+    return 0;
+}
+
+//This is total number of files there can exist in the system.
+#define MAX_FILES_SYSTEM ((MAX_DIRS_IN_ROOT)*(MAX_FILES_IN_DIR))
+
+/*
+ *Find where to write the file on disk. Starting at the begnning of map.
+ */
+ static long findFreeSpace(){
+	 const map * data = liveMap();
+	 long start = freeHint;
+	 int seen = 0;
+
+	 long i = 0;
+	 //go through the .disk file looking for a free spot
+	 //to write our file.
+
+	 STAT_ADD(stats.allocScans, 1);
+	 for(i = start; i<MAX_BLOCK_FOR_FILE; i++){
+		 if(data->blockmap[i]!=0){
+			 continue;
+		 }
+		 if(!seen){
+			 freeHint = i;
+			 seen = 1;
+		 }
+		 if(!isPinned(i)){
+				TRACE(TRACE_DEBUG, "FREE SPACE POINT INDEX = %ld", i);
+				STAT_ADD(stats.allocScanned, i-start+1);
+		 		return i;
+	 		}
+
+ 	 }
+	 if(!seen){
+		 freeHint = MAX_BLOCK_FOR_FILE;
+	 }
+	 STAT_ADD(stats.allocScanned, MAX_BLOCK_FOR_FILE-start);
+ 	 return -1;
+
+ }
+
+/*
+ *This function starts at the end of the bit map, and finds the end
+ *where a free block exists.
+ */
+static int findEnd(){
+	const map * data = liveMap();
+	int i = 0;
+	for(i = MAX_BLOCK_FOR_FILE-1; i>-1; i--){
+		if(data->blockmap[i]!=0||isPinned(i)){
+			return i+1;
+		}
+	}
+	return -1;
+}
+
+/*
+ *How many blocks a file of fsize bytes sits in. Empty files still own
+ *the block mknod gave them.
+ */
+static long fileBlocks(off_t fsize){
+	if(fsize==0){
+		return 1;
+	}
+	return (fsize+BLOCK_SIZE-1)/BLOCK_SIZE;
+}
+
+
+/*
+ *Writes marks as the map bytes of the count blocks from index. Only the
+ *bytes that change are written to .disk, nothing at all if none do.
+ */
+static int writeMapRange(int index, int count, const unsigned char *marks){
+	int first = 0;
+	int last = count-1;
+	int i;
+
+	pthread_once(&mapOnce, loadMap);
+	while(first<count&&mapCache.blockmap[index+first]==marks[first]){
+		first++;
+	}
+	if(first==count){
+		return 1;
+	}
+	while(mapCache.blockmap[index+last]==marks[last]){
+		last--;
+	}
+	memcpy(mapCache.blockmap+index+first, marks+first, last-first+1);
+	for(i = first; i<=last&&index+i<freeHint; i++){
+		if(marks[i]==0){
+			freeHint = index+i;
+			break;
+		}
+	}
+	pthread_mutex_lock(&batchLock);
+	if(batchCreating){
+		if(batchMapLo==-1||index+first<batchMapLo){
+			batchMapLo = index+first;
+		}
+		if(index+last>batchMapHi){
+			batchMapHi = index+last;
+		}
+		pthread_mutex_unlock(&batchLock);
+		return 1;
+	}
+	pthread_mutex_unlock(&batchLock);
+	return diskWrite(marks+first, last-first+1, mapOffset+index+first);
+}
+
+/*
+ *This function marks count blocks starting at index as taken or free.
+ */
+ static int updateMapRange(int index, int count, char cond){
+		unsigned char * bits = (unsigned char *)malloc(count);
+		int ret;
+		memset(bits, cond, count);
+		ret = writeMapRange(index, count, bits);
+		free(bits);
+		return ret;
+ }
+
+/*
+ *This function updates the bitmap, with whether the block is taken or not.
+ */
+ static int updateMap(int index, char cond){
+		return updateMapRange(index, 1, cond);
+ }
+
+/*
+ *Returns the map byte of the block at index.
+ */
+static unsigned char mapEntry(int index){
+	return liveMap()->blockmap[index];
+}
+
+/*
+ *Reads the map bytes of the count blocks from index into marks.
+ */
+static void readMapRange(int index, int count, unsigned char *marks){
+	memcpy(marks, liveMap()->blockmap+index, count);
+}
+
+/*
+ *Small files. With -o small_files, mknod doesn't give a new file a block
+ *of its own but a SMALL_FILE_MAX byte slot in a block shared with other
+ *small files, marked MAP_PACKED in the map. nStartBlock is a byte offset
+ *anyway, so it just points into the middle of that block. A file is
+ *promoted to a block of its own the first time it grows past its slot.
+ *Packed files are recognized by the map, so an image that has them can
+ *be mounted without the option too.
+ */
+#define MAP_PACKED 2
+#define SMALL_FILE_MAX 64
+#define SMALL_SLOTS (BLOCK_SIZE / SMALL_FILE_MAX)
+#define BLOCK_INDEX(start) ((int)(((start) - FILE_START) / BLOCK_SIZE))
+#define SLOT_INDEX(start) ((int)((((start) - FILE_START) % BLOCK_SIZE) / SMALL_FILE_MAX))
+
+static int isPacked(long start){
+	return mapEntry(BLOCK_INDEX(start))==MAP_PACKED;
+}
+
+/*
+ *Fills masks, one byte per block, with the slots in use in each packed
+ *block. Bit n is set if some file starts in slot n.
+ */
+static void packedSlotMasks(map *data, unsigned char *masks){
+	cs1550_root_directory *root = readRoot();
+	int i;
+	int j;
+
+	memset(masks, 0, MAX_BLOCK_FOR_FILE);
+	for(i = 0; i<root->nDirectories; i++){
+		cs1550_directory_entry *dir = readDir(root->directories[i].nStartBlock);
+		for(j = 0; j<dir->nFiles; j++){
+			long start = dir->files[j].nStartBlock;
+			if(data->blockmap[BLOCK_INDEX(start)]==MAP_PACKED){
+				masks[BLOCK_INDEX(start)] |= 1 << SLOT_INDEX(start);
+			}
+		}
+		free(dir);
+	}
+	free(root);
+}
+
+/*
+ *Finds a free slot for a new small file, packing a new block if all the
+ *packed ones are full. The slot is zeroed. Returns its offset, or -1 if
+ *the disk is full.
+ */
+static long allocSmallSlot(){
+	static unsigned char masks[MAX_BLOCK_FOR_FILE];
+	static const char zeros[SMALL_FILE_MAX];
+	map *data = (map *)malloc(sizeof(map));
+	long start = -1;
+	int i;
+	int s;
+
+	readMap(data);
+	packedSlotMasks(data, masks);
+	for(i = 0; i<MAX_BLOCK_FOR_FILE&&start==-1; i++){
+		//a slot free now may still be in use in the snapshot
+		if(data->blockmap[i]!=MAP_PACKED||masks[i]==(1 << SMALL_SLOTS)-1||isPinned(i)){
+			continue;
+		}
+		for(s = 0; masks[i] & (1 << s); s++){
+		}
+		start = FILE_START+((long)i*BLOCK_SIZE)+(s*SMALL_FILE_MAX);
+		diskWrite(zeros, SMALL_FILE_MAX, start);
+	}
+	free(data);
+	if(start!=-1){
+		return start;
+	}
+
+	i = findFreeSpace();
+	if(i==-1){
+		return -1;
+	}
+	cs1550_disk_block *block = (cs1550_disk_block *)calloc(1, sizeof(cs1550_disk_block));
+	start = FILE_START+((long)i*BLOCK_SIZE);
+	writeFile(start, block);
+	updateMap(i, MAP_PACKED);
+	free(block);
+	return start;
+}
+
+/*
+ *The first run of count free blocks, none of them pinned, that starts at
+ *or after block from. -1 if there isn't one.
+ */
+static int findFreeRun(int count, int from){
+	const map *data = liveMap();
+	int run = 0;
+	int i;
+
+	STAT_ADD(stats.allocScans, 1);
+	for(i = from; i<MAX_BLOCK_FOR_FILE; i++){
+		if(data->blockmap[i]!=0||isPinned(i)){
+			run = 0;
+			continue;
+		}
+		if(++run==count){
+			STAT_ADD(stats.allocScanned, i-from+1);
+			return i-count+1;
+		}
+	}
+	if(from<MAX_BLOCK_FOR_FILE){
+		STAT_ADD(stats.allocScanned, MAX_BLOCK_FOR_FILE-from);
+	}
+	return -1;
+}
+
+/*
+ *Placement. A new file goes PLACE_HEADROOM blocks past the end of the
+ *last file in its directory, so the files of a directory sit together
+ *and each has room to grow before it runs into the next one. The first
+ *file of a directory goes the same distance past the last block in use,
+ *away from the other directories' files. A file that can't have its
+ *headroom goes in the first free block from there, or anywhere.
+ */
+#define PLACE_HEADROOM 8
+
+static int placementGoal(long dirOff){
+	cs1550_directory_entry *dir = readDir(dirOff);
+	int goal = -1;
+	int j;
+
+	for(j = 0; j<dir->nFiles; j++){
+		int end = BLOCK_INDEX(dir->files[j].nStartBlock)+fileBlocks(dir->files[j].fsize);
+		if(end>goal){
+			goal = end;
+		}
+	}
+	free(dir);
+	if(goal==-1){
+		goal = findEnd();
+	}
+	if(goal<=0){
+		return 0;
+	}
+	return goal+PLACE_HEADROOM;
+}
+
+/*
+ *Where a new file of the directory at dirOff should start. -1 if the disk
+ *is full.
+ */
+static long placeFile(long dirOff){
+	int goal = placementGoal(dirOff);
+	int index = findFreeRun(1+PLACE_HEADROOM, goal);
+
+	if(index==-1){
+		index = findFreeRun(1, goal);
+	}
+	if(index==-1){
+		index = findFreeSpace();
+	}
+	if(index!=-1&&index!=goal){
+		STAT_ADD(stats.placedAway, 1);
+	}
+	return index;
+}
+
+/*
+ *Gives a new, empty file of the directory at dirOff somewhere to live: a
+ *small file slot with -o small_files, a zeroed block of its own, placed
+ *near its siblings, otherwise. Returns its start, or -1 if the disk is
+ *full.
+ */
+static long allocFileStart(long dirOff){
+	if(config.smallFiles){
+		return allocSmallSlot();
+	}
+	long index = placeFile(dirOff);
+	if(index==-1){
+		return -1;
+	}
+	cs1550_disk_block *block = (cs1550_disk_block *)calloc(1, sizeof(cs1550_disk_block));
+	long start = FILE_START+(index*BLOCK_SIZE);
+	updateMap(index, 1);
+	writeFile(start, block);
+	free(block);
+	return start;
+}
+
+/*
+ *Frees the packed block the slot at start is in, once no file is left
+ *in it.
+ */
+static void releaseSlot(long start){
+	static unsigned char masks[MAX_BLOCK_FOR_FILE];
+	map *data = (map *)malloc(sizeof(map));
+	readMap(data);
+	packedSlotMasks(data, masks);
+	if(masks[BLOCK_INDEX(start)]==0){
+		updateMap(BLOCK_INDEX(start), 0);
+	}
+	free(data);
+}
+
+/*
+ *Moves file fileIndex of the directory at dirOff out of its slot into a
+ *block of its own, so the normal write path can grow it. The packed block
+ *is freed when its last file leaves. Returns the new start, or -ENOSPC if
+ *the disk is full.
+ */
+static long promoteSmallFile(long dirOff, int fileIndex){
+	cs1550_directory_entry *dir = readDir(dirOff);
+	long oldStart = dir->files[fileIndex].nStartBlock;
+	long index = findFreeSpace();
+
+	if(index==-1){
+		free(dir);
+		return -ENOSPC;
+	}
+	cs1550_disk_block *block = (cs1550_disk_block *)calloc(1, sizeof(cs1550_disk_block));
+	diskRead(block, dir->files[fileIndex].fsize, oldStart);
+	long start = FILE_START+(index*BLOCK_SIZE);
+	diskWrite(block, BLOCK_SIZE, start);
+	updateMap(index, 1);
+	free(block);
+	dir->files[fileIndex].nStartBlock = start;
+	updateDir(dirOff, dir);
+	free(dir);
+	TRACE(TRACE_DEBUG, "PROMOTED SMALL FILE FROM %ld TO %ld", oldStart, start);
+
+	releaseSlot(oldStart);
+	return start;
+}
+
+/*
+ *Holes. A write past the end of a file doesn't write the blocks it skips
+ *over, it marks them MAP_HOLE. They still belong to the file, but what
+ *is in them is never read: they read back as zeros until something is
+ *written in them. The first block of a file is never a hole.
+ */
+#define MAP_HOLE 5
+
+/*
+ *Zeroes the parts of buf, read from len bytes of .disk at offset, that
+ *lie in holes of the map m, or of the live map if m is NULL.
+ */
+static void zeroHoles(char *buf, size_t len, off_t offset, const map *m){
+	if(len==0){
+		return;
+	}
+	int first = BLOCK_INDEX(offset);
+	int count = BLOCK_INDEX(offset+len-1)-first+1;
+	const unsigned char *marks = (m!=NULL ? m : liveMap())->blockmap+first;
+	int b;
+
+	for(b = 0; b<count; b++){
+		if(marks[b]!=MAP_HOLE){
+			continue;
+		}
+		off_t from = FILE_START+((off_t)(first+b)*BLOCK_SIZE);
+		off_t to = from+BLOCK_SIZE;
+		if(from<offset){
+			from = offset;
+		}
+		if(to>offset+(off_t)len){
+			to = offset+len;
+		}
+		memset(buf+(from-offset), 0, to-from);
+	}
+}
+
+/*
+ *Compressed files. With -o compress a file is compressed when it is
+ *closed, into one extent that starts where the file did: an extentHeader
+ *and then the compressed bytes. Its first block is marked MAP_COMPRESSED
+ *in the map and the blocks it no longer needs are freed. Reads decompress
+ *the whole file into a one file cache, and the next write expands it
+ *back to plain blocks first. Data that doesn't compress by at least a
+ *block is left as it is.
+ */
+#define MAP_COMPRESSED 3
+
+struct extentHeader {
+	unsigned int rawLen;	//fsize of the file when it was compressed
+	unsigned int packedLen;	//compressed bytes after the header
+};
+
+/*
+ *The codec is a byte-aligned LZ77 in the style of the LZ4 block format.
+ *Each sequence is a token (literal count in the high nibble, match
+ *length - LZ_MIN_MATCH in the low one, 15 meaning more length bytes
+ *follow), the literals, then a 2 byte little endian match offset and any
+ *more match length bytes. The last sequence is literals only.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 0xffff
+
+static int lzLength(unsigned char *dst, int cap, int *op, int n){
+	for(n -= 15; n>=255; n -= 255){
+		if(*op>=cap){
+			return -1;
+		}
+		dst[(*op)++] = 255;
+	}
+	if(*op>=cap){
+		return -1;
+	}
+	dst[(*op)++] = n;
+	return 0;
+}
+
+static int lzSequence(unsigned char *dst, int cap, int *op, const unsigned char *lit,
+	int litLen, int offset, int matchLen){
+	int m = matchLen ? matchLen-LZ_MIN_MATCH : 0;
+
+	if(*op>=cap){
+		return -1;
+	}
+	dst[(*op)++] = ((litLen<15 ? litLen : 15) << 4) | (m<15 ? m : 15);
+	if(litLen>=15&&lzLength(dst, cap, op, litLen)!=0){
+		return -1;
+	}
+	if(*op+litLen>cap){
+		return -1;
+	}
+	memcpy(dst+*op, lit, litLen);
+	*op += litLen;
+	if(matchLen==0){
+		return 0;
+	}
+	if(*op+2>cap){
+		return -1;
+	}
+	dst[(*op)++] = offset & 0xff;
+	dst[(*op)++] = offset >> 8;
+	if(m>=15&&lzLength(dst, cap, op, m)!=0){
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *Compresses len bytes of src into dst. Returns the compressed length, or
+ *-1 if it doesn't fit in cap bytes.
+ */
+static int lzCompress(const unsigned char *src, int len, unsigned char *dst, int cap){
+	int table[1 << LZ_HASH_BITS];
+	int ip = 0;
+	int anchor = 0;
+	int op = 0;
+
+	memset(table, 0xff, sizeof(table));
+	while(ip+LZ_MIN_MATCH<=len){
+		unsigned int seq;
+		memcpy(&seq, src+ip, sizeof(seq));
+		int h = (seq*2654435761u) >> (32-LZ_HASH_BITS);
+		int ref = table[h];
+		table[h] = ip;
+		if(ref<0||ip-ref>LZ_MAX_OFFSET||memcmp(src+ref, src+ip, LZ_MIN_MATCH)!=0){
+			ip++;
+			continue;
+		}
+		int m = LZ_MIN_MATCH;
+		while(ip+m<len&&src[ref+m]==src[ip+m]){
+			m++;
+		}
+		if(lzSequence(dst, cap, &op, src+anchor, ip-anchor, ip-ref, m)!=0){
+			return -1;
+		}
+		ip += m;
+		anchor = ip;
+	}
+	if(lzSequence(dst, cap, &op, src+anchor, len-anchor, 0, 0)!=0){
+		return -1;
+	}
+	return op;
+}
+
+/*
+ *Decompresses len bytes of src into dst. Returns the decompressed length,
+ *or -1 if src is corrupt or decompresses to more than cap bytes.
+ */
+static int lzDecompress(const unsigned char *src, int len, unsigned char *dst, int cap){
+	int ip = 0;
+	int op = 0;
+
+	while(ip<len){
+		int token = src[ip++];
+		int n = token >> 4;
+		if(n==15){
+			do{
+				if(ip>=len){
+					return -1;
+				}
+				n += src[ip];
+			}while(src[ip++]==255);
+		}
+		if(ip+n>len||op+n>cap){
+			return -1;
+		}
+		memcpy(dst+op, src+ip, n);
+		ip += n;
+		op += n;
+		if(ip==len){
+			break;
+		}
+		if(ip+2>len){
+			return -1;
+		}
+		int offset = src[ip] | (src[ip+1] << 8);
+		ip += 2;
+		n = token & 15;
+		if(n==15){
+			do{
+				if(ip>=len){
+					return -1;
+				}
+				n += src[ip];
+			}while(src[ip++]==255);
+		}
+		n += LZ_MIN_MATCH;
+		if(offset==0||offset>op||op+n>cap){
+			return -1;
+		}
+		//the match may overlap what it is copying, so go a byte at a time
+		while(n--){
+			dst[op] = dst[op-offset];
+			op++;
+		}
+	}
+	return op;
+}
+
+static int isCompressed(long start){
+	return mapEntry(BLOCK_INDEX(start))==MAP_COMPRESSED;
+}
+
+/*
+ *Deduplicated files. With -o dedup, flush looks a file's contents up in
+ *an index of fingerprints of files flushed before. If an identical file
+ *is found, the two share its extent, the first block of which is marked
+ *MAP_DEDUPED, and the copy's blocks are freed. Who shares an extent is
+ *worked out from the directories, every file whose nStartBlock is the
+ *same. A write to a shared file gives it its own copy first.
+ */
+#define MAP_DEDUPED 4
+
+static int isShared(long start){
+	return mapEntry(BLOCK_INDEX(start))==MAP_DEDUPED;
+}
+
+/*
+ *How many blocks the compressed extent at start takes up.
+ */
+static int compressedBlocks(long start){
+	struct extentHeader hdr;
+	diskRead(&hdr, sizeof(hdr), start);
+	return (sizeof(hdr)+hdr.packedLen+BLOCK_SIZE-1)/BLOCK_SIZE;
+}
+
+/*
+ *Decompresses the extent at start, which holds fsize bytes, into out.
+ *Returns 0, or -1 if the extent is corrupt.
+ */
+static int inflateExtent(long start, char *out, size_t fsize){
+	struct extentHeader hdr;
+	int n;
+
+	diskRead(&hdr, sizeof(hdr), start);
+	if(hdr.rawLen!=fsize||hdr.packedLen>(unsigned int)MAX_BLOCK_FOR_FILE*BLOCK_SIZE){
+		return -1;
+	}
+	unsigned char *packed = (unsigned char *)malloc(hdr.packedLen);
+	diskRead(packed, hdr.packedLen, start+sizeof(hdr));
+	if(verifyBlocks(packed, hdr.packedLen, start+sizeof(hdr))!=0){
+		free(packed);
+		return -1;
+	}
+	n = lzDecompress(packed, hdr.packedLen, (unsigned char *)out, fsize);
+	free(packed);
+	STAT_ADD(stats.inflates, 1);
+	return n==(int)fsize ? 0 : -1;
+}
+
+/*
+ *The last compressed file read, decompressed, keyed by where it starts.
+ *Anything that puts a compressed extent somewhere or takes one away
+ *calls dropInflated, so a start that matches is always current.
+ */
+static long inflatedStart = -1;
+static char *inflatedData = NULL;
+static pthread_mutex_t inflatedLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dropInflated(){
+	pthread_mutex_lock(&inflatedLock);
+	inflatedStart = -1;
+	free(inflatedData);
+	inflatedData = NULL;
+	pthread_mutex_unlock(&inflatedLock);
+}
+
+/*
+ *Copies size bytes at offset of the compressed file at start into buf.
+ *Returns 0, or -1 if the extent is corrupt.
+ */
+static int readCompressed(char *buf, size_t size, off_t offset, long start, size_t fsize){
+	pthread_mutex_lock(&inflatedLock);
+	if(inflatedStart!=start){
+		char *data = (char *)malloc(fsize);
+		if(inflateExtent(start, data, fsize)!=0){
+			free(data);
+			pthread_mutex_unlock(&inflatedLock);
+			return -1;
+		}
+		free(inflatedData);
+		inflatedData = data;
+		inflatedStart = start;
+	}
+	memcpy(buf, inflatedData+offset, size);
+	pthread_mutex_unlock(&inflatedLock);
+	return 0;
+}
+
+/*
+ * Does the actual creation of a file. Mode and dev can be ignored.
+ *
+ */
+static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	(void) mode;
+	(void) dev;
+
+	if(isSnapPath(path)){
+		return -EROFS;
+	}
+	if(checkAccess(path)!=0){
+		return -EPERM;
+	}
+	negForget(path);
+	int i;
+	cs1550_root_directory* root;
+	char directory[NAME_BUF];
+	char  filename[NAME_BUF];
+	char extension[EXT_BUF];
+	splitPath(path, directory, filename, extension);
+	TRACE(TRACE_DEBUG, "PATH : %s", path);
+	TRACE(TRACE_DEBUG, "DIR NAME: %s", directory);
+	TRACE(TRACE_DEBUG, "FILE NAME: %s", filename);
+	TRACE(TRACE_DEBUG, "EXT NAME: %s", extension);
+	if(strlen(filename)>8||strlen(extension)>3){
+		return -ENAMETOOLONG;
+	}
+	//make sure user is not trying to create file in root
+
+
+	root = readRoot();
+
+
+	for(i = 0; i<MAX_DIRS_IN_ROOT; i++){
+
+		char *dirName = root->directories[i].dname;
+
+		if(strcmp(dirName, directory)==0){
+			int startBlock = root->directories[i].nStartBlock;
+			cs1550_directory_entry * dir = readDir(startBlock);
+
+			//if there are no files in the directory
+			//write the first file
+			if(dir->nFiles==MAX_FILES_IN_DIR){
+				TRACE(TRACE_ERROR, "CANOT CREATE MORE FILES IN THIS DIR");
+				return -EPERM;
+			}
+			if(dir->nFiles==0){
+				TRACE(TRACE_DEBUG, "Making first file : %s", filename);
+				dir->nFiles = dir->nFiles+1;
+				strcpy(dir->files[0].fname, filename);
+				strcpy(dir->files[0].fext, extension);
+				dir->files[0].fsize = 0;
+
+				openBatch(startBlock);
+				long start = allocFileStart(startBlock);
+				if(start==-1){
+					closeBatch(0);
+					free(dir);
+					return -ENOSPC;
+				}
+				TRACE(TRACE_DEBUG, "Start : %ld", start);
+				dir->files[0].nStartBlock = start;
+				updateDir(startBlock, dir);
+				closeBatch(1);
+				bumpSlot(i, 0);
+			}
+			//else find next free space and write it there
+			else{
+				TRACE(TRACE_DEBUG, "Making not first file: %s", filename);
+				int numOfFiles = dir->nFiles;
+				strcpy(dir->files[numOfFiles].fname, filename);
+				strcpy(dir->files[numOfFiles].fext, extension);
+				dir->files[numOfFiles].fsize = 0;
+				openBatch(startBlock);
+				long start = allocFileStart(startBlock);
+				if(start==-1){
+					closeBatch(0);
+					free(dir);
+					return -ENOSPC;
+				}
+				TRACE(TRACE_DEBUG, "Start : %ld", start);
+				dir->files[numOfFiles].nStartBlock = start;
+				dir->nFiles = dir->nFiles+1;
+				updateDir(startBlock, dir);
+				closeBatch(1);
+				bumpSlot(i, numOfFiles);
+			}
+		}
+	}
+
+
 
-	//save the start block
-	startBlock = BLOCK_SIZE+(directoryNum*BLOCK_SIZE);
-	//add one to the number of directoreis
-	root->nDirectories = root->nDirectories+1;
-	//write the root back to disk, and directory entry to disk
-	writeRoot(root);
-	writeDir(startBlock);
 	return 0;
 }
 
 /*
- * Removes a directory.
+ * Deletes a file
+ */
+static int cs1550_unlink(const char *path)
+{
+    (void) path;
+
+    return 0;
+}
+
+/*
+ *read for files under /.snapshot. The blocks are pinned, so they still
+ *hold what the file had when the snapshot was taken, and the frozen map
+ *says how the file is stored.
+ */
+static int snapRead(const char *rel, char *buf, size_t size, off_t offset){
+	int dirIndex;
+	int fileIndex;
+	int ret = snapResolve(rel, &dirIndex, &fileIndex);
+
+	if(ret!=0){
+		return ret;
+	}
+	if(fileIndex==-1){
+		return -EISDIR;
+	}
+	long start = snapDirs[dirIndex].files[fileIndex].nStartBlock;
+	size_t fsize = snapDirs[dirIndex].files[fileIndex].fsize;
+	if(offset>=(off_t)fsize){
+		return 0;
+	}
+	if(size>fsize-offset){
+		size = fsize-offset;
+	}
+	if(snapMap.blockmap[BLOCK_INDEX(start)]==MAP_COMPRESSED){
+		ret = readCompressed(buf, size, offset, start, fsize);
+	}
+	else{
+		diskRead(buf, size, start+offset);
+		ret = verifyBlocks(buf, size, start+offset);
+		zeroHoles(buf, size, start+offset, &snapMap);
+	}
+	return (ret!=0) ? -EIO : (int)size;
+}
+
+/*
+ * Read size bytes from file into buf starting from offset
+ *
+ */
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	int dirIndex;
+	int fileIndex;
+	int ret;
+	TRACE(TRACE_DEBUG, "SIZE OF SIZE_T = %zu", size);
+
+	if(strcmp(path, STATS_PATH)==0){
+		char text[STATS_BUF];
+		int len = renderStats(text, sizeof(text));
+		if(offset>=len){
+			return 0;
+		}
+		if(size>len-offset){
+			size = len-offset;
+		}
+		memcpy(buf, text+offset, size);
+		return size;
+	}
+	if(isSnapPath(path)){
+		return snapRead(path+strlen(SNAP_DIR), buf, size, offset);
+	}
+	ret = fileSlots(path, fi, &dirIndex, &fileIndex);
+
+	if(ret==-EISDIR){
+		return -EISDIR;
+	}
+	//check to make sure path exists
+	if(ret!=0){
+		return -1;
+	}
+	//check that size is > 0
+	if(size<1){
+		return -1;
+	}
+
+	struct cs1550_directory_entry* dir = readDir(DIR_OFFSET(dirIndex));
+	int fileSize = dir->files[fileIndex].fsize;
+	int fileStart = dir->files[fileIndex].nStartBlock;
+	free(dir);
+	TRACE(TRACE_DEBUG, "THE FILE SIZE IS FROM FILE READ %d", fileSize);
+	//nothing to read at or past the end
+	if(offset>=fileSize){
+		return 0;
+	}
+	if(size>fileSize-offset){
+		size = fileSize-offset;
+	}
+
+	unsigned char kind = mapEntry(BLOCK_INDEX(fileStart));
+	if(kind==MAP_COMPRESSED){
+		if(readCompressed(buf, size, offset, fileStart, fileSize)!=0){
+			return -EIO;
+		}
+		return size;
+	}
+
+	int seekPoint = fileStart + offset;
+	TRACE(TRACE_DEBUG, "FILESTART %d", fileStart);
+	TRACE(TRACE_DEBUG, "SEEKPOINT %d", seekPoint);
+	//files are contiguous, so all the blocks come in with one read. A
+	//small file shares its block, but only its own bytes are asked for.
+	diskRead(buf, size, seekPoint);
+	if(verifyBlocks(buf, size, seekPoint)!=0){
+		return -EIO;
+	}
+	if(kind!=MAP_PACKED){
+		zeroHoles(buf, size, seekPoint, NULL);
+	}
+	return size;
+}
+
+/*
+ *Writes data to file, if the data is less than 512 bytes.
+ */
+static int writeDataToFile(const char* buf, size_t size, long startBlock, off_t offset){
+
+	return diskWrite(buf, size, startBlock + offset);
+	}
+
+/*
+ *Writes count contiguous blocks straight from buf, in one call.
+ */
+static int writeBlocks(const char * buf, int count, long offset){
+	return diskWrite(buf, count*BLOCK_SIZE, offset);
+}
+
+/*
+ *Moves count blocks of file data from map index from to map index to and
+ *updates the map. The ranges may overlap, the whole run is read before
+ *anything is written, so this can slide a file over its own blocks.
+ */
+static void relocateBlocks(int from, int to, int count){
+	//every block keeps its mark when it moves: packed, compressed,
+	//shared and holes
+	unsigned char *marks = (unsigned char *)malloc(count);
+	readMapRange(from, count, marks);
+	//the file is contiguous, so copy all of it with one read
+	//and one write and move its map bytes a run at a time.
+	char * copy = (char *)malloc(count*BLOCK_SIZE);
+	diskRead(copy, count*BLOCK_SIZE, FILE_START+((long)from*BLOCK_SIZE));
+	//update the map with free spaces got from moving this file
+	updateMapRange(from, count, 0);
+	TRACE(TRACE_DEBUG, "MAP UPDATE : INDEXES FREED: %d - %d", from, from+count-1);
+	diskWrite(copy, count*BLOCK_SIZE, FILE_START+((long)to*BLOCK_SIZE));
+	writeMapRange(to, count, marks);
+	TRACE(TRACE_DEBUG, "MAP UPDATED : %d - %d", to, to+count-1);
+	if(marks[0]==MAP_COMPRESSED){
+		dropInflated();
+	}
+	free(marks);
+	free(copy);
+	STAT_ADD(stats.blocksCopied, count);
+}
+
+/*
+ *Where moveFiles and moveWhole put count blocks: after the last used
+ *block, or if that is too close to the end, the first gap big enough at
+ *or past block after. -1 if they don't fit anywhere past after.
+ */
+static int moveTarget(int count, int after){
+	int freePoint = findEnd();
+	if(freePoint<after){
+		freePoint = after;
+	}
+	if(freePoint+count>MAX_BLOCK_FOR_FILE){
+		return findFreeRun(count, after);
+	}
+	return freePoint;
+}
+
+/*
+ *Moves the count blocks at index to the end as a whole and points every
+ *file that starts in them at the new place. For runs more than one file
+ *lives in: packed blocks and shared extents.
+ */
+static long moveWhole(int index, int count, int after){
+	cs1550_root_directory *root = readRoot();
+	int freePoint = moveTarget(count, after);
+	int i;
+	int j;
+
+	if(freePoint==-1){
+		free(root);
+		return -1;
+	}
+	long shift = (long)(freePoint-index)*BLOCK_SIZE;
+	relocateBlocks(index, freePoint, count);
+	for(i = 0; i<root->nDirectories; i++){
+		long dirOff = root->directories[i].nStartBlock;
+		cs1550_directory_entry *dir = readDir(dirOff);
+		int changed = 0;
+		for(j = 0; j<dir->nFiles; j++){
+			int at = BLOCK_INDEX(dir->files[j].nStartBlock);
+			if(at>=index&&at<index+count){
+				dir->files[j].nStartBlock += shift;
+				changed = 1;
+			}
+		}
+		if(changed){
+			updateDir(dirOff, dir);
+		}
+		free(dir);
+	}
+	free(root);
+	TRACE(TRACE_DEBUG, "MOVED %d SHARED BLOCKS FROM %d TO %d", count, index, freePoint);
+	STAT_ADD(stats.relocations, 1);
+	return 1;
+}
+
+/*
+ *This function moves file to the end, that is blocking some file that is trying to apend.
+ *It goes no lower than block after, so it is out of the blocks the caller wants.
+ *Returns 1 if a file was moved, -1 if no file starts at location or it doesn't fit.
+ */
+static long moveFiles(long location, int after){
+		if(isPacked(location)){
+			return moveWhole(BLOCK_INDEX(location), 1, after);
+		}
+		cs1550_root_directory * root = readRoot();
+		int i = 0;
+		int j = 0;
+		int totalDirs = root->nDirectories;
+		for(i = 0; i<totalDirs; i++){
+			char * dirName = root->directories[i].dname;
+			int dirOff = findOffset(dirName);
+			cs1550_directory_entry *dir = readDir(dirOff);
+			for(j = 0; j<dir->nFiles; j++){
+				long startBlock = dir->files[j].nStartBlock;
+				TRACE(TRACE_DEBUG, "NAME : %s",dir->files[j].fname);
+				TRACE(TRACE_DEBUG, "START : %ld",dir->files[j].nStartBlock);
+				if(startBlock==location){
+						long retSize = dir->files[j].fsize;
+						if(isShared(startBlock)){
+							free(dir);
+							free(root);
+							return moveWhole(BLOCK_INDEX(startBlock), fileBlocks(retSize), after);
+						}
+
+						TRACE(TRACE_DEBUG, "MOVING BLOCKING FILE");
+						TRACE(TRACE_DEBUG, "MOVING FILE: %s", dir->files[j].fname);
+						int blocks = fileBlocks(retSize);
+						//a compressed file is only as long as its extent
+						if(isCompressed(startBlock)){
+							blocks = compressedBlocks(startBlock);
+						}
+						int freePoint = moveTarget(blocks, after);
+						if(freePoint==-1){
+							free(dir);
+							free(root);
+							return -1;
+						}
+						long newLocation = FILE_START+((long)freePoint*BLOCK_SIZE);
+
+						int startToLook = ((startBlock-FILE_START)/BLOCK_SIZE);
+						relocateBlocks(startToLook, freePoint, blocks);
+						dir->files[j].nStartBlock = newLocation;
+						TRACE(TRACE_DEBUG, "NEW LOCATION: %ld", newLocation);
+						STAT_ADD(stats.relocations, 1);
+						updateDir(dirOff, dir);
+						return 1;
+
+
+				}
+			}
+		}
+		return -1;
+}
+
+/*
+ *Handlers that change the image (and the defragmenter) hold fsLock for
+ *writing, the rest hold it for reading. It is taken in the timed_*
+ *wrappers hello_oper points at.
  */
-static int cs1550_rmdir(const char *path)
-{
-	(void) path;
-    return 0;
-}
+static pthread_rwlock_t fsLock = PTHREAD_RWLOCK_INITIALIZER;
 
-//This is total number of files there can exist in the system.
-#define MAX_FILES_SYSTEM ((MAX_DIRS_IN_ROOT)*(MAX_FILES_IN_DIR))
+struct fileRef {
+	int start;	//map index of the first block
+	int dirIndex;
+	int fileIndex;
+};
+
+static int cmpFileRef(const void *a, const void *b){
+	return ((const struct fileRef *)a)->start - ((const struct fileRef *)b)->start;
+}
 
 /*
- *Find where to write the file on disk. Starting at the begnning of map.
+ *One step of the defragmenter: finds the first file, in disk order, that
+ *has free blocks right in front of it and slides it down over them.
+ *Doing this over and over packs the files at the start of the image and
+ *leaves one big free run at the end. Returns 1 if a file was moved, 0 if
+ *the image is already packed. Caller holds fsLock for writing.
  */
- static long findFreeSpace(){
-	 map * data = (map *)malloc(sizeof(map));
-	 FILE * fp = fopen(".disk", "rb+");
-	 fseek(fp, -sizeof(map), SEEK_END);
-	 fread(data, sizeof(map), 1, fp);
+static int defragStep(){
+	static struct fileRef files[MAX_FILES_SYSTEM];
+	cs1550_root_directory *root = readRoot();
+	map *data = (map *)malloc(sizeof(map));
+	int nFiles = 0;
+	int moved = 0;
+	int i;
+	int j;
+
+	readMap(data);
+	for(i = 0; i<root->nDirectories; i++){
+		cs1550_directory_entry *dir = readDir(root->directories[i].nStartBlock);
+		for(j = 0; j<dir->nFiles; j++){
+			//packed blocks and shared extents stay where they are
+			unsigned char kind = data->blockmap[BLOCK_INDEX(dir->files[j].nStartBlock)];
+			if(kind==MAP_PACKED||kind==MAP_DEDUPED){
+				continue;
+			}
+			files[nFiles].start = (dir->files[j].nStartBlock-FILE_START)/BLOCK_SIZE;
+			files[nFiles].dirIndex = i;
+			files[nFiles].fileIndex = j;
+			nFiles++;
+		}
+		free(dir);
+	}
+	qsort(files, nFiles, sizeof(struct fileRef), cmpFileRef);
 
-	 long i = 0;
-	 //go through the .disk file looking for a free spot
-	 //to write our file.
+	for(i = 0; i<nFiles&&!moved; i++){
+		int hole = files[i].start;
+		while(hole>0&&data->blockmap[hole-1]==0&&!isPinned(hole-1)){
+			hole--;
+		}
+		if(hole<files[i].start){
+			long dirOff = root->directories[files[i].dirIndex].nStartBlock;
+			cs1550_directory_entry *dir = readDir(dirOff);
+			int f = files[i].fileIndex;
+			int count = fileBlocks(dir->files[f].fsize);
+			if(data->blockmap[files[i].start]==MAP_COMPRESSED){
+				count = compressedBlocks(dir->files[f].nStartBlock);
+			}
+			//sliding over its own blocks would change the snapshot's copy
+			if(rangePinned(hole, count)){
+				free(dir);
+				continue;
+			}
+			TRACE(TRACE_INFO, "DEFRAG: %s FROM %d TO %d", dir->files[f].fname, files[i].start, hole);
+			relocateBlocks(files[i].start, hole, count);
+			dir->files[f].nStartBlock = FILE_START+((long)hole*BLOCK_SIZE);
+			updateDir(dirOff, dir);
+			free(dir);
+			STAT_ADD(stats.defragMoves, 1);
+			moved = 1;
+		}
+	}
 
-	 for(i = 0; i<MAX_BLOCK_FOR_FILE; i++){
-		 if(data->blockmap[i]==0){
-				fprintf(stderr, "FREE SPACE POINT INDEX = %d\n", i);
-				fclose(fp);
-		 		return i;
-	 		}
+	free(data);
+	free(root);
+	return moved;
+}
 
- 	 }
-	 fclose(fp);
- 	 return -1;
+static pthread_t defragTid;
+static int defragRunning = 0;
+static volatile int defragStop = 0;
 
- }
+#ifndef CS1550_NO_MAIN
+/*
+ *kill -USR2 pauses the defragmenter, and resumes it the next time.
+ */
+static void defragSignal(int sig){
+	(void) sig;
+	defragPaused = !defragPaused;
+}
+#endif
+
+static void *defragThread(void *arg){
+	(void) arg;
+	//stay out of the way of the threads serving requests
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+	while(!defragStop){
+		int moved = 0;
+		if(!defragPaused&&pthread_rwlock_trywrlock(&fsLock)==0){
+			moved = defragStep();
+			pthread_rwlock_unlock(&fsLock);
+			if(!moved){
+				STAT_ADD(stats.defragIdle, 1);
+			}
+		}
+		//nothing to do, check back in a second
+		if(!moved){
+			sleep(1);
+		}
+		else{
+			usleep(1000000/config.defragRate);
+		}
+	}
+	return NULL;
+}
 
+/*
+ *With -o ram, checkpoints the image every config.checkpoint seconds. The
+ *checkpoint only needs fsLock for reading, so requests that only read
+ *carry on while it writes. An open create batch is written out first,
+ *which needs it for writing.
+ */
+static pthread_t checkpointTid;
+static int checkpointRunning = 0;
+static volatile int checkpointStop = 0;
+
+static void *checkpointThread(void *arg){
+	unsigned int waited = 0;
+	(void) arg;
+	while(!checkpointStop){
+		sleep(1);
+		if(++waited<config.checkpoint){
+			continue;
+		}
+		waited = 0;
+		if(batchPending()){
+			pthread_rwlock_wrlock(&fsLock);
+			flushCreates();
+			pthread_rwlock_unlock(&fsLock);
+		}
+		pthread_rwlock_rdlock(&fsLock);
+		checkpointImage();
+		pthread_rwlock_unlock(&fsLock);
+	}
+	return NULL;
+}
 
 /*
- *This function updates the bitmap, with whether the block is taken or not.
+ *Writes out the open create batch every CREATE_FLUSH_MS ms, so a file
+ *made in a quiet moment reaches .disk soon after. It takes fsLock for
+ *writing, and only when there is a batch to write.
  */
- static int updateMap(int index, char cond){
-	 	map * data = (map *)malloc(sizeof(map));
-		FILE * fp = fopen(".disk", "rb+");
-		fseek(fp, -sizeof(map), SEEK_END);
-		fread(data, sizeof(map), 1, fp);
-		data->blockmap[index] = cond;
-		fseek(fp, -sizeof(map), SEEK_END);
-		fwrite(data,1, sizeof(map), fp);
-		fclose(fp);
- }
+static pthread_t createTid;
+static int createRunning = 0;
+static volatile int createStop = 0;
+
+static void *createThread(void *arg){
+	(void) arg;
+	while(!createStop){
+		usleep(CREATE_FLUSH_MS*1000);
+		if(batchPending()){
+			pthread_rwlock_wrlock(&fsLock);
+			flushCreates();
+			pthread_rwlock_unlock(&fsLock);
+		}
+	}
+	return NULL;
+}
 
 /*
- * Does the actual creation of a file. Mode and dev can be ignored.
- *
+ *Saves the mount index, see loadIndex. Called at unmount once nothing
+ *else will write to the image.
  */
-static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
-{
-	(void) mode;
-	(void) dev;
+static void saveIndex(){
+	struct mountIndex *idx;
+	cs1550_root_directory *root;
+	int fd;
+	int i;
 
-	if(checkAccess(path)!=0){
-		return -EPERM;
+	if(disks[0].fd==-1){
+		return;
 	}
-	int i;
-	cs1550_root_directory* root;
-	char directory[8] = "0";
-	char  filename[8] = "0";
-	char extension[3] = "";
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	fprintf(stderr, "PATH : %s\n", path);
-	fprintf(stderr, "DIR NAME: %s\n", directory);
-	fprintf(stderr, "FILE NAME: %s\n", filename);
-	fprintf(stderr, "EXT NAME: %s\n", extension);
-	if(strlen(filename)>8||strlen(extension)>3){
-		return -ENAMETOOLONG;
+	idx = (struct mountIndex *)malloc(sizeof(*idx));
+	if(idx==NULL){
+		return;
 	}
-	//make sure user is not trying to create file in root
-
-
 	root = readRoot();
+	memcpy(&idx->root, root, sizeof(idx->root));
+	free(root);
+	for(i = 0; i<MAX_DIRS_IN_ROOT; i++){
+		cs1550_directory_entry *dir = readDir(DIR_OFFSET(i));
+		memcpy(&idx->dirs[i], dir, sizeof(idx->dirs[i]));
+		free(dir);
+	}
+	readMap(&idx->blocks);
+	//the index is only good for the image as it is on disk
+	for(i = 0; i<nDisks; i++){
+		fdatasync(disks[i].fd);
+	}
+	stampDisks(&idx->h);
+	idx->h.freeHint = freeHint;
+	fd = open(idxPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd!=-1){
+		if(fullIO(fd, idx, sizeof(*idx), 0, 1)!=1||fsync(fd)!=0){
+			unlink(idxPath);
+		}
+		close(fd);
+	}
+	free(idx);
+}
 
+/*
+ *Without an index to load them from, reads root, every directory block
+ *and the map into their caches in the background, one at a time so it
+ *never holds fsLock for long, and they are all there for saveIndex.
+ */
+static pthread_t warmTid;
+static int warmRunning = 0;
 
+static void *warmThread(void *arg){
+	int i;
+	(void) arg;
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+	pthread_rwlock_rdlock(&fsLock);
+	free(readRoot());
+	pthread_rwlock_unlock(&fsLock);
 	for(i = 0; i<MAX_DIRS_IN_ROOT; i++){
+		pthread_rwlock_rdlock(&fsLock);
+		free(readDir(DIR_OFFSET(i)));
+		pthread_rwlock_unlock(&fsLock);
+	}
+	pthread_rwlock_rdlock(&fsLock);
+	liveMap();
+	pthread_rwlock_unlock(&fsLock);
+	return NULL;
+}
 
-		char *dirName = root->directories[i].dname;
+/*
+ *This function finds contiguous blocks from some index, for writing.
+ */
+static int findContigBlocks(int index){
+	STAT_ADD(stats.allocScans, 1);
+	STAT_ADD(stats.allocScanned, 1);
+	//only the one byte of the map we care about
+	if(mapEntry(index)==0&&!isPinned(index)){
+		return 1;
+	}
 
-		if(strcmp(dirName, directory)==0){
-			int startBlock = root->directories[i].nStartBlock;
-			cs1550_directory_entry * dir = readDir(startBlock);
+	return -1;
+}
 
-			//if there are no files in the directory
-			//write the first file
-			if(dir->nFiles==MAX_FILES_IN_DIR){
-				fprintf(stderr, "CANOT CREATE MORE FILES IN THIS DIR\n");
-				return -EPERM;
-			}
-			if(dir->nFiles==0){
-				fprintf(stderr, "Making first file : %s\n", filename);
-				dir->nFiles = dir->nFiles+1;
-				strcpy(dir->files[0].fname, filename);
-				strcpy(dir->files[0].fext, extension);
-				dir->files[0].fsize = 0;
+/*
+ *Traces the start of the bitmap, for debugging the write path.
+ */
+ static int printBitMap(){
+	 //don't even read the map unless the lines would be kept
+	 if(CS1550_TRACE_LEVEL<TRACE_DEBUG){
+		 return 1;
+	 }
+	 map * data = (map *)malloc(sizeof(map));
+	 readMap(data);
+	 int i;
+	 for(i = 0; i<50; i++){
+		 TRACE(TRACE_DEBUG, "BIT[%d] = %d", i, data->blockmap[i]);
+	 }
 
-				long start = findFreeSpace();
-				updateMap(start, 1);
-				start = (start*512)+FILE_START;
-				fprintf(stderr,"Start : %d\n", start);
-				dir->files[0].nStartBlock = start;
-				cs1550_disk_block *data = (cs1550_disk_block *)malloc(sizeof(cs1550_disk_block));
-				writeFile(start, data);
-				updateDir(startBlock, dir);
-			}
-			//else find next free space and write it there
-			else{
-				fprintf(stderr, "Making not first file: %s\n", filename);
-				int numOfFiles = dir->nFiles;
-				strcpy(dir->files[numOfFiles].fname, filename);
-				strcpy(dir->files[numOfFiles].fext, extension);
-				dir->files[numOfFiles].fsize = 0;
-				long start = findFreeSpace();
-				fprintf(stderr,"Writing file at index %d\n", start);
-				updateMap(start, 1);
-				start = (start*512)+FILE_START;
-				fprintf(stderr,"Start : %d\n", start);
-				dir->files[numOfFiles].nStartBlock = start;
-				cs1550_disk_block *data = (cs1550_disk_block *)malloc(sizeof(cs1550_disk_block));
-				dir->nFiles = dir->nFiles+1;
-				writeFile(start, data);
-				updateDir(startBlock, dir);
+	 free(data);
+	 return 1;
+ }
+/*
+ *Compresses file fileIndex of the directory at dirOff in place, if it is
+ *plain and takes at least a block less compressed. Called on flush with
+ *-o compress, fsLock held for writing.
+ */
+static int compressFile(long dirOff, int fileIndex){
+	struct extentHeader hdr;
+	cs1550_directory_entry *dir = readDir(dirOff);
+	long start = dir->files[fileIndex].nStartBlock;
+	size_t fsize = dir->files[fileIndex].fsize;
+	int blocks = fileBlocks(fsize);
+	free(dir);
+
+	//compressing rewrites the blocks in place, the snapshot's are left alone
+	if(blocks<2||mapEntry(BLOCK_INDEX(start))!=1||rangePinned(BLOCK_INDEX(start), blocks)){
+		return 0;
+	}
+	unsigned char *raw = (unsigned char *)malloc(fsize);
+	unsigned char *out = (unsigned char *)malloc((blocks-1)*BLOCK_SIZE);
+	diskRead(raw, fsize, start);
+	zeroHoles((char *)raw, fsize, start, NULL);
+	//only worth it if it saves at least one block
+	int len = lzCompress(raw, fsize, out+sizeof(hdr), (blocks-1)*BLOCK_SIZE-sizeof(hdr));
+	free(raw);
+	if(len==-1){
+		free(out);
+		return 0;
+	}
+	hdr.rawLen = fsize;
+	hdr.packedLen = len;
+	memcpy(out, &hdr, sizeof(hdr));
+	int packed = (sizeof(hdr)+len+BLOCK_SIZE-1)/BLOCK_SIZE;
+	memset(out+sizeof(hdr)+len, 0, packed*BLOCK_SIZE-sizeof(hdr)-len);
+	writeBlocks((char *)out, packed, start);
+	free(out);
+	updateMap(BLOCK_INDEX(start), MAP_COMPRESSED);
+	//the extent may cover what were holes
+	if(packed>1){
+		updateMapRange(BLOCK_INDEX(start)+1, packed-1, 1);
+	}
+	updateMapRange(BLOCK_INDEX(start)+packed, blocks-packed, 0);
+	dropInflated();
+	TRACE(TRACE_DEBUG, "COMPRESSED %d BLOCKS INTO %d AT %ld", blocks, packed, start);
+	STAT_ADD(stats.compressed, 1);
+	STAT_ADD(stats.compressSaved, blocks-packed);
+	return 1;
+}
+
+/*
+ *Turns the compressed file fileIndex of the directory at dirOff back into
+ *plain blocks, where it is if there's room or after the last used block
+ *if not, so the write path can change it. Returns the new start, -EIO if
+ *the extent is corrupt or -ENOSPC if it doesn't fit anywhere.
+ */
+static long expandFile(long dirOff, int fileIndex){
+	cs1550_directory_entry *dir = readDir(dirOff);
+	long start = dir->files[fileIndex].nStartBlock;
+	size_t fsize = dir->files[fileIndex].fsize;
+	int from = BLOCK_INDEX(start);
+	int packed = compressedBlocks(start);
+	int blocks = fileBlocks(fsize);
+	int to = from;
+	int i;
+
+	char *raw = (char *)calloc(blocks, BLOCK_SIZE);
+	if(inflateExtent(start, raw, fsize)!=0){
+		free(raw);
+		free(dir);
+		return -EIO;
+	}
+	updateMapRange(from, packed, 0);
+	for(i = from; i<from+blocks; i++){
+		if(i>=MAX_BLOCK_FOR_FILE||findContigBlocks(i)!=1){
+			to = findEnd();
+			if(to==-1){
+				to = 0;
 			}
+			break;
 		}
 	}
+	if(to+blocks>MAX_BLOCK_FOR_FILE){
+		updateMapRange(from, packed, 1);
+		updateMap(from, MAP_COMPRESSED);
+		free(raw);
+		free(dir);
+		return -ENOSPC;
+	}
+	start = FILE_START+((long)to*BLOCK_SIZE);
+	writeBlocks(raw, blocks, start);
+	updateMapRange(to, blocks, 1);
+	free(raw);
+	dir->files[fileIndex].nStartBlock = start;
+	updateDir(dirOff, dir);
+	free(dir);
+	dropInflated();
+	TRACE(TRACE_DEBUG, "EXPANDED %d BLOCKS FROM %d TO %d", blocks, from, to);
+	STAT_ADD(stats.expanded, 1);
+	return start;
+}
+
+/*
+ *64 bit fingerprint of a file's contents for the dedup index, mixed 8
+ *bytes at a time. Matches are always compared byte for byte before
+ *anything is shared, so it only has to spread well.
+ */
+static unsigned long long fingerprint(const unsigned char *data, size_t len){
+	unsigned long long h = 0x9e3779b97f4a7c15ULL ^ len;
+	size_t i;
+
+	for(i = 0; i+8<=len; i += 8){
+		unsigned long long v;
+		memcpy(&v, data+i, sizeof(v));
+		h ^= v*0x87c37b91114253d5ULL;
+		h = ((h << 31) | (h >> 33))*0x4cf5ad432745937fULL;
+	}
+	for(; i<len; i++){
+		h = (h ^ data[i])*0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
 
+/*
+ *The index only lives in memory and only knows files flushed since the
+ *mount. It is direct mapped, a new fingerprint just replaces whatever was
+ *in its slot. Entries can go stale when files change, so a hit is
+ *checked against the directories and the data before it is used. Only
+ *touched with fsLock held for writing.
+ */
+#define DEDUP_SLOTS 1024
 
+struct dedupEntry {
+	unsigned long long hash;
+	long start;	//0 for an empty slot
+	size_t fsize;
+};
 
-	return 0;
-}
+static struct dedupEntry dedupIndex[DEDUP_SLOTS];
 
 /*
- * Deletes a file
+ *Counts the files that start at start and are fsize bytes long.
  */
-static int cs1550_unlink(const char *path)
-{
-    (void) path;
+static int countSharers(long start, size_t fsize){
+	cs1550_root_directory *root = readRoot();
+	int count = 0;
+	int i;
+	int j;
 
-    return 0;
+	for(i = 0; i<root->nDirectories; i++){
+		cs1550_directory_entry *dir = readDir(root->directories[i].nStartBlock);
+		for(j = 0; j<dir->nFiles; j++){
+			if(dir->files[j].nStartBlock==start&&dir->files[j].fsize==fsize){
+				count++;
+			}
+		}
+		free(dir);
+	}
+	free(root);
+	return count;
 }
 
 /*
- *This function takes a block, some position(in buffer), and writes the block to the buffer.
+ *Checks that start is still a plain or shared file of fsize bytes that
+ *holds exactly raw.
  */
-static int writeBlockToBuf(char *buf, cs1550_disk_block * block, int pos){
-	int i = 0;
-	for(i = 0; i<BLOCK_SIZE; i++){
-		buf[pos+i] = block->data[i];
+static int sameFile(long start, const unsigned char *raw, size_t fsize){
+	unsigned char kind = mapEntry(BLOCK_INDEX(start));
+	int same;
+
+	if((kind!=1&&kind!=MAP_DEDUPED)||countSharers(start, fsize)==0){
+		return 0;
 	}
-	pos = pos+BLOCK_SIZE;
-	return pos;
+	unsigned char *data = (unsigned char *)malloc(fsize);
+	diskRead(data, fsize, start);
+	zeroHoles((char *)data, fsize, start, NULL);
+	same = memcmp(data, raw, fsize)==0;
+	free(data);
+	return same;
 }
+
 /*
- * Read size bytes from file into buf starting from offset
- *
+ *Looks file fileIndex of the directory at dirOff up in the dedup index
+ *and, if it is a copy of a file there, points it at that file's extent
+ *and frees its own blocks. Otherwise adds it to the index. Returns 1 if
+ *the file is now shared.
  */
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
-			  struct fuse_file_info *fi)
-{
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
-	char directory[8];
-	char  filename[8];
-	char extension[3];
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	fprintf(stderr, "SIZE OF SIZE_T = %d\n", size);
-
-	if(checkAccess(path)!=0){
-		return -EISDIR;
+static int dedupFile(long dirOff, int fileIndex){
+	cs1550_directory_entry *dir = readDir(dirOff);
+	long start = dir->files[fileIndex].nStartBlock;
+	size_t fsize = dir->files[fileIndex].fsize;
+	int shared = 0;
+
+	if(fsize==0||mapEntry(BLOCK_INDEX(start))!=1){
+		free(dir);
+		return 0;
 	}
-	//check to make sure path exists
-	struct cs1550_directory_entry* dir = fileExist(path);
-	int i;
-	//check to make sure path exists
-	if(dir==NULL){
-		return -1;
+	unsigned char *raw = (unsigned char *)malloc(fsize);
+	diskRead(raw, fsize, start);
+	zeroHoles((char *)raw, fsize, start, NULL);
+	unsigned long long hash = fingerprint(raw, fsize);
+	struct dedupEntry *e = &dedupIndex[hash % DEDUP_SLOTS];
+
+	if(e->start!=0&&e->start!=start&&e->hash==hash&&e->fsize==fsize&&sameFile(e->start, raw, fsize)){
+		updateMapRange(BLOCK_INDEX(start), fileBlocks(fsize), 0);
+		updateMap(BLOCK_INDEX(e->start), MAP_DEDUPED);
+		dir->files[fileIndex].nStartBlock = e->start;
+		updateDir(dirOff, dir);
+		TRACE(TRACE_DEBUG, "DEDUP %s NOW SHARES %ld", dir->files[fileIndex].fname, e->start);
+		STAT_ADD(stats.deduped, 1);
+		STAT_ADD(stats.dedupSaved, fileBlocks(fsize));
+		shared = 1;
 	}
-	//check that size is > 0
-	if(size<1){
-		return -1;
+	else{
+		e->hash = hash;
+		e->start = start;
+		e->fsize = fsize;
 	}
+	free(raw);
+	free(dir);
+	return shared;
+}
 
-	if(dir!=NULL){
-		for(i = 0; i<dir->nFiles; i++){
-				char *name = dir->files[i].fname;
-				if(strcmp(name, filename)==0){
-					int fileSize = dir->files[i].fsize;
-					int fileStart = dir->files[i].nStartBlock;
-					fprintf(stderr, "THE FILE SIZE IS FROM FILE READ %d\n", fileSize);
-					//check that offset is <= to the file size
-					if(offset<=fileSize){
-						int numOfBlocks = (size/BLOCK_SIZE);
-						FILE * fp = fopen(".disk", "rb+");
-						int seekPoint = fileStart + offset;
-						fprintf(stderr, "FILESTART %d\n", fileStart);
-						fprintf(stderr, "SEEKPOINT %d\n", seekPoint);
-						cs1550_disk_block *block = (cs1550_disk_block*)malloc(sizeof(cs1550_disk_block));
-						int pos = 0;
-						int retPos = 0;
-
-						for(i = 0; i<numOfBlocks; i++){
-							//read in data
-							fprintf(stderr, "READING FROM : %d\n", pos);
-							fseek(fp, seekPoint+(BLOCK_SIZE*i), SEEK_SET);
-							fread(block, sizeof(cs1550_disk_block), 1, fp);
-							retPos = writeBlockToBuf(buf, block, pos);
-							pos = retPos;
-						}
-						free(block);
-						fclose(fp);
-						return size;
-					}
-					else{
-						return -1;
-					}
-				}
-		}
+/*
+ *Copies the blocks of file fileIndex of the directory at dirOff after the
+ *last used block and points the file at the copy. Holes are filled in
+ *with zeros and the old blocks are left as they are. Returns the new
+ *start, or -ENOSPC if it doesn't fit.
+ */
+static long copyToEnd(long dirOff, int fileIndex){
+	cs1550_directory_entry *dir = readDir(dirOff);
+	long start = dir->files[fileIndex].nStartBlock;
+	int blocks = fileBlocks(dir->files[fileIndex].fsize);
+	int to = findEnd();
+
+	if(to==-1||to+blocks>MAX_BLOCK_FOR_FILE){
+		free(dir);
+		return -ENOSPC;
 	}
+	char *copy = (char *)malloc(blocks*BLOCK_SIZE);
+	diskRead(copy, blocks*BLOCK_SIZE, start);
+	zeroHoles(copy, blocks*BLOCK_SIZE, start, NULL);
+	long newStart = FILE_START+((long)to*BLOCK_SIZE);
+	writeBlocks(copy, blocks, newStart);
+	updateMapRange(to, blocks, 1);
+	free(copy);
+	dir->files[fileIndex].nStartBlock = newStart;
+	updateDir(dirOff, dir);
+	free(dir);
+	return newStart;
+}
 
+/*
+ *Gives file fileIndex of the directory at dirOff, which shares its
+ *extent, a copy of its own, so the write path can change it. Returns the
+ *new start, or -ENOSPC if it doesn't fit.
+ */
+static long unshareFile(long dirOff, int fileIndex){
+	cs1550_directory_entry *dir = readDir(dirOff);
+	long start = dir->files[fileIndex].nStartBlock;
+	size_t fsize = dir->files[fileIndex].fsize;
+	free(dir);
+	long newStart = copyToEnd(dirOff, fileIndex);
+
+	if(newStart<0){
+		return newStart;
+	}
+	//the last one left has it to itself again
+	if(countSharers(start, fsize)==1){
+		updateMap(BLOCK_INDEX(start), 1);
+	}
+	TRACE(TRACE_DEBUG, "UNSHARED %ld TO %ld", start, newStart);
+	STAT_ADD(stats.unshared, 1);
+	return newStart;
+}
 
+/*
+ *Gives file fileIndex of the directory at dirOff, which is about to be
+ *written in or into blocks the snapshot has, a copy of its own and frees
+ *its old blocks, which stay pinned for the snapshot. Returns the new
+ *start, or -ENOSPC if it doesn't fit.
+ */
+static long cowFile(long dirOff, int fileIndex){
+	cs1550_directory_entry *dir = readDir(dirOff);
+	long start = dir->files[fileIndex].nStartBlock;
+	int blocks = fileBlocks(dir->files[fileIndex].fsize);
+	free(dir);
+	long newStart = copyToEnd(dirOff, fileIndex);
+
+	if(newStart<0){
+		return newStart;
+	}
+	updateMapRange(BLOCK_INDEX(start), blocks, 0);
+	TRACE(TRACE_DEBUG, "COPIED %ld TO %ld FOR THE SNAPSHOT", start, newStart);
+	STAT_ADD(stats.snapCopies, 1);
+	return newStart;
+}
 
+/*
+ *Makes dest, which must not exist yet, a copy of file srcFile of
+ *directory srcDir without the data leaving .disk. A plain or shared file
+ *is shared with the copy, as dedup would, and is copied on the next
+ *write to either. A small file is copied into the copy's own slot or
+ *block, and a compressed extent is copied block for block after the last
+ *used block. Returns 0 or a negative errno.
+ */
+static int cloneFile(int srcDir, int srcFile, const char *dest){
+	int destDir;
+	int destFile;
+	int ret = resolveFile(dest, &destDir, &destFile);
 
-	//set size and return, or error
+	if(ret==0||ret==-EISDIR){
+		return -EEXIST;
+	}
+	ret = cs1550_mknod(dest, S_IFREG | 0644, 0);
+	if(ret!=0){
+		return ret;
+	}
+	if(resolveFile(dest, &destDir, &destFile)!=0){
+		return -ENOENT;
+	}
 
-	return -1;
+	cs1550_directory_entry *src = readDir(DIR_OFFSET(srcDir));
+	long start = src->files[srcFile].nStartBlock;
+	size_t fsize = src->files[srcFile].fsize;
+	free(src);
+	cs1550_directory_entry *dir = readDir(DIR_OFFSET(destDir));
+	long fresh = dir->files[destFile].nStartBlock;
+	unsigned char kind = mapEntry(BLOCK_INDEX(start));
+	unsigned char freshKind = mapEntry(BLOCK_INDEX(fresh));
+
+	if(kind==MAP_PACKED){
+		//fits in whatever mknod just gave the copy
+		char small[SMALL_FILE_MAX];
+		diskRead(small, fsize, start);
+		diskWrite(small, fsize, fresh);
+		STAT_ADD(stats.clonesCopied, 1);
+	}
+	else if(kind==MAP_COMPRESSED){
+		int count = compressedBlocks(start);
+		int to = findEnd();
+		if(to+count>MAX_BLOCK_FOR_FILE){
+			free(dir);
+			return -ENOSPC;
+		}
+		char *copy = (char *)malloc(count*BLOCK_SIZE);
+		diskRead(copy, count*BLOCK_SIZE, start);
+		writeBlocks(copy, count, FILE_START+((long)to*BLOCK_SIZE));
+		free(copy);
+		updateMapRange(to, count, 1);
+		updateMap(to, MAP_COMPRESSED);
+		dir->files[destFile].nStartBlock = FILE_START+((long)to*BLOCK_SIZE);
+		STAT_ADD(stats.clonesCopied, 1);
+	}
+	else{
+		updateMap(BLOCK_INDEX(start), MAP_DEDUPED);
+		dir->files[destFile].nStartBlock = start;
+		STAT_ADD(stats.clonesShared, 1);
+	}
+	dir->files[destFile].fsize = fsize;
+	updateDir(DIR_OFFSET(destDir), dir);
+	free(dir);
+
+	//give back what mknod allocated, if the copy didn't end up in it
+	if(kind!=MAP_PACKED){
+		if(freshKind==MAP_PACKED){
+			releaseSlot(fresh);
+		}
+		else{
+			updateMap(BLOCK_INDEX(fresh), 0);
+		}
+	}
+	TRACE(TRACE_DEBUG, "CLONED %ld TO %s", start, dest);
+	return 0;
 }
 
 /*
- *Writes data to file, if the data is less than 512 bytes.
+ *Consistency checker. Walks root and every directory, works out which
+ *blocks each file owns and what the map should say about them, and
+ *compares that with the map. A crash in the middle of moveFiles, for
+ *one, can leave a file's blocks marked free. Directories are checked by
+ *FSCK_THREADS threads at once. fsck_cs1550.c runs it on an image, and
+ *-o fsck runs it at mount with FSCK_REPAIR. Both run it before anything
+ *else reads the image, so it reads the root, directory and map blocks
+ *themselves and never the mount index. FSCK_FULL also decompresses
+ *every compressed file to check it. Programs that include this file with
+ *CS1550_NO_MAIN only get it if they define CS1550_FSCK as well.
  */
-static int writeDataToFile(const char* buf, size_t size, long startBlock, off_t offset){
+#if !defined(CS1550_NO_MAIN)||defined(CS1550_FSCK)
+#define FSCK_THREADS 4
+#define FSCK_REPAIR 1
+#define FSCK_FULL 2
+#define FSCK_PATH (2 * NAME_BUF + EXT_BUF + 2)
+
+struct fsckOwner {
+	char path[FSCK_PATH];
+	long start;
+	size_t fsize;
+	int first;		//map index of the first block it owns
+	int count;		//how many, 0 if the entry is too broken to count
+	unsigned char kind;	//1, MAP_PACKED or MAP_COMPRESSED
+};
 
-	FILE * fp = fopen(".disk", "rb+");
-	int seekPoint = startBlock + offset;
-	fseek(fp, seekPoint, SEEK_SET);
-	fwrite(buf, size, 1, fp);
-	fclose(fp);
-	}
+struct fsckJob {
+	int thread;
+	int flags;
+	cs1550_root_directory *root;
+	map *data;
+	FILE *out;
+	int problems;
+};
+
+static struct fsckOwner fsckOwners[MAX_DIRS_IN_ROOT][MAX_FILES_IN_DIR];
+static int fsckFiles[MAX_DIRS_IN_ROOT];
 
 /*
- *Writes individual blocks to file.
+ *Checks one directory entry and fills in owner. Returns how many
+ *problems it found.
  */
-static int writeBlockToFile(cs1550_disk_block * block, long offset){
-	FILE * fp = fopen(".disk", "rb+");
-	fseek(fp, offset, SEEK_SET);
-	fwrite(block, sizeof(cs1550_disk_block), 1, fp);
-	fclose(fp);
-	return 1;
+static int fsckFile(struct fsckJob *job, const char *dname, struct cs1550_file_directory *file,
+	struct fsckOwner *owner){
+	long rel = file->nStartBlock-FILE_START;
+
+	owner->start = file->nStartBlock;
+	owner->fsize = file->fsize;
+	owner->count = 0;
+	owner->kind = 1;
+	if(memchr(file->fname, 0, sizeof(file->fname))==NULL||memchr(file->fext, 0, sizeof(file->fext))==NULL){
+		fprintf(job->out, "/%s: file entry with a name that isn't terminated\n", dname);
+		strcpy(owner->path, "?");
+		return 1;
+	}
+	snprintf(owner->path, FSCK_PATH, "/%s/%s%s%s", dname, file->fname, file->fext[0] ? "." : "", file->fext);
+	if(rel<0||rel/BLOCK_SIZE>=MAX_BLOCK_FOR_FILE){
+		fprintf(job->out, "%s: starts at %ld, outside the data blocks\n", owner->path, owner->start);
+		return 1;
+	}
+	owner->first = rel/BLOCK_SIZE;
+	unsigned char mark = job->data->blockmap[owner->first];
+	if(rel%BLOCK_SIZE!=0||mark==MAP_PACKED){
+		if(rel%SMALL_FILE_MAX!=0||owner->fsize>SMALL_FILE_MAX){
+			fprintf(job->out, "%s: %lu bytes at %ld is neither a block nor a small file slot\n",
+				owner->path, (unsigned long)owner->fsize, owner->start);
+			return 1;
+		}
+		owner->kind = MAP_PACKED;
+		owner->count = 1;
+		return 0;
+	}
+	if(mark==MAP_COMPRESSED){
+		struct extentHeader hdr;
+		diskRead(&hdr, sizeof(hdr), owner->start);
+		if(hdr.rawLen!=owner->fsize){
+			fprintf(job->out, "%s: compressed extent holds %u bytes, the entry says %lu\n",
+				owner->path, hdr.rawLen, (unsigned long)owner->fsize);
+			return 1;
+		}
+		owner->kind = MAP_COMPRESSED;
+		owner->count = compressedBlocks(owner->start);
+	}
+	else{
+		owner->count = fileBlocks(owner->fsize);
+	}
+	if(owner->first+owner->count>MAX_BLOCK_FOR_FILE){
+		fprintf(job->out, "%s: %d blocks from %d run past the last data block\n",
+			owner->path, owner->count, owner->first);
+		owner->count = 0;
+		return 1;
+	}
+	if(owner->kind==MAP_COMPRESSED&&(job->flags & FSCK_FULL)){
+		char *raw = (char *)malloc(owner->fsize);
+		int bad = inflateExtent(owner->start, raw, owner->fsize)!=0;
+		free(raw);
+		if(bad){
+			fprintf(job->out, "%s: compressed extent is corrupt\n", owner->path);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void *fsckDirs(void *arg){
+	struct fsckJob *job = (struct fsckJob *)arg;
+	int i;
+	int j;
+
+	for(i = job->thread; i<job->root->nDirectories; i += FSCK_THREADS){
+		char *dname = job->root->directories[i].dname;
+		long dirOff = job->root->directories[i].nStartBlock;
+		fsckFiles[i] = 0;
+		if(memchr(dname, 0, MAX_FILENAME+1)==NULL){
+			fprintf(job->out, "directory %d: name isn't terminated\n", i);
+			job->problems++;
+			continue;
+		}
+		if(dirOff!=DIR_OFFSET(i)){
+			fprintf(job->out, "/%s: directory block at %ld, should be %ld\n", dname, dirOff, (long)DIR_OFFSET(i));
+			job->problems++;
+			continue;
+		}
+		cs1550_directory_entry *dir = readDir(dirOff);
+		if(dir->nFiles<0||dir->nFiles>(MAX_FILES_IN_DIR)){
+			fprintf(job->out, "/%s: says it holds %d files\n", dname, dir->nFiles);
+			job->problems++;
+			free(dir);
+			continue;
+		}
+		fsckFiles[i] = dir->nFiles;
+		for(j = 0; j<dir->nFiles; j++){
+			job->problems += fsckFile(job, dname, &dir->files[j], &fsckOwners[i][j]);
+		}
+		free(dir);
+	}
+	return NULL;
 }
 
 /*
- *This function read the data from the file to a block and returns it.
+ *Run through indexOnce instead of loadIndex by fsckImage, which has to
+ *check the blocks in the image, not the copy of them in the index. The
+ *index is then neither loaded nor removed.
  */
-static cs1550_disk_block * readDataToBlock(long offset){
-	cs1550_disk_block *block = (cs1550_disk_block*)malloc(sizeof(cs1550_disk_block));
-	FILE * fp = fopen(".disk", "rb+");
-	fseek(fp, offset, SEEK_SET);
-	fread(block, sizeof(cs1550_disk_block), 1, fp);
-	fclose(fp);
-	return block;
+static void skipIndex(){
 }
 
 /*
- *This function starts at the end of the bit map, and finds the end
- *where a free block exists.
+ *Checks the image, printing what is wrong to out. With FSCK_REPAIR a map
+ *that doesn't match the directories is rebuilt from them, and *repaired
+ *is set. Nothing else is changed. Returns how many problems were found.
  */
-static int findEnd(){
-	map * data = (map *)malloc(sizeof(map));
-	FILE * fp = fopen(".disk", "rb+");
-	fseek(fp, -sizeof(map), SEEK_END);
-	fread(data, sizeof(map), 1, fp);
-	int i = 0;
-	for(i = MAX_BLOCK_FOR_FILE; i>-1; i--){
-		if(data->blockmap[i]==1){
-			fclose(fp);
-			return i+1;
+static int fsckImage(int flags, FILE *out, int *repaired){
+	static int owner[MAX_BLOCK_FOR_FILE];
+	cs1550_root_directory *root;
+	map *data;
+	map *want;
+	pthread_t tids[FSCK_THREADS];
+	struct fsckJob jobs[FSCK_THREADS];
+	int problems = 0;
+	int unmarked = 0;
+	int leaked = 0;
+	int wrongMark = 0;
+	int i;
+	int j;
+	int b;
+
+	*repaired = 0;
+	//before the first read of the image, so nothing comes from the index
+	pthread_once(&indexOnce, skipIndex);
+	root = readRoot();
+	data = (map *)malloc(sizeof(map));
+	want = (map *)calloc(1, sizeof(map));
+	readMap(data);
+	if(root->nDirectories<0||root->nDirectories>(MAX_DIRS_IN_ROOT)){
+		fprintf(out, "root says it holds %d directories, not checking any further\n", root->nDirectories);
+		free(want);
+		free(data);
+		free(root);
+		return 1;
+	}
+	for(i = 0; i<FSCK_THREADS; i++){
+		jobs[i].thread = i;
+		jobs[i].flags = flags;
+		jobs[i].root = root;
+		jobs[i].data = data;
+		jobs[i].out = out;
+		jobs[i].problems = 0;
+		pthread_create(&tids[i], NULL, fsckDirs, &jobs[i]);
+	}
+	for(i = 0; i<FSCK_THREADS; i++){
+		pthread_join(tids[i], NULL);
+		problems += jobs[i].problems;
+	}
+
+	//owner holds 1 + the (directory, file) slot of the first file to claim each block
+	memset(owner, 0, sizeof(owner));
+	for(i = 0; i<root->nDirectories; i++){
+		for(j = 0; j<fsckFiles[i]; j++){
+			struct fsckOwner *o = &fsckOwners[i][j];
+			int overlaps = 0;
+			for(b = o->first; b<o->first+o->count; b++){
+				if(owner[b]==0){
+					owner[b] = 1+(i*(MAX_FILES_IN_DIR))+j;
+					want->blockmap[b] = 1;
+					//holes past the first block of a plain file
+					if(o->kind==1&&b!=o->first&&data->blockmap[b]==MAP_HOLE){
+						want->blockmap[b] = MAP_HOLE;
+					}
+					continue;
+				}
+				struct fsckOwner *other = &fsckOwners[(owner[b]-1)/(MAX_FILES_IN_DIR)][(owner[b]-1)%(MAX_FILES_IN_DIR)];
+				//small files in different slots of one block
+				if(o->kind==MAP_PACKED&&other->kind==MAP_PACKED&&o->start!=other->start){
+					continue;
+				}
+				//dedup'ed copies of one file
+				if(o->kind==1&&other->kind==1&&o->start==other->start&&o->fsize==other->fsize){
+					want->blockmap[o->first] = MAP_DEDUPED;
+					continue;
+				}
+				//keep going, so a rebuilt map still has the rest of its blocks
+				if(!overlaps){
+					fprintf(out, "%s: block %d is also %s's\n", o->path, b, other->path);
+					problems++;
+					overlaps = 1;
+				}
+			}
+			if(o->count>0&&o->kind!=1){
+				want->blockmap[o->first] = o->kind;
+			}
 		}
 	}
-	fclose(fp);
-	return -1;
+
+	for(b = 0; b<MAX_BLOCK_FOR_FILE; b++){
+		if(data->blockmap[b]==want->blockmap[b]){
+			continue;
+		}
+		if(data->blockmap[b]==0){
+			unmarked++;
+		}
+		else if(want->blockmap[b]==0){
+			leaked++;
+		}
+		else{
+			wrongMark++;
+		}
+	}
+	if(unmarked||leaked||wrongMark){
+		fprintf(out, "map: %d blocks in use marked free, %d free blocks marked in use, %d marked as the wrong kind\n",
+			unmarked, leaked, wrongMark);
+		problems++;
+		if(flags & FSCK_REPAIR){
+			writeMapRange(0, MAX_BLOCK_FOR_FILE, want->blockmap);
+			fprintf(out, "map: rebuilt from the directories\n");
+			*repaired = 1;
+		}
+	}
+
+	free(want);
+	free(data);
+	free(root);
+	return problems;
 }
+#endif
 
 /*
- *This function moves file to the end, that is blocking some file that is trying to apend.
+ *The largest write request the kernel sends us, passed to it at mount
+ *as max_write. The write path below takes a request of any size, but
+ *pinning this keeps the kernel from splitting writes differently from
+ *one kernel or libfuse to the next (big_writes), so replay/run.sh and
+ *its baselines see the same requests everywhere.
  */
-static long moveFiles(long location, long fileSize){
-		cs1550_root_directory * root = readRoot();
-		int i = 0;
-		int j = 0;
-		int totalDirs = root->nDirectories;
-		for(i = 0; i<totalDirs; i++){
-			char * dirName = root->directories[i].dname;
-			int dirOff = findOffset(dirName);
-			cs1550_directory_entry *dir = readDir(dirOff);
-			for(j = 0; j<dir->nFiles; j++){
-				long startBlock = dir->files[j].nStartBlock;
-				fprintf(stderr, "NAME : %s\n",dir->files[j].fname);
-				fprintf(stderr, "START : %d\n",dir->files[j].nStartBlock);
-				if(startBlock==location){
-						long retSize = dir->files[j].fsize;
-
-						fprintf(stderr, "MOVING BLOCKING FILE\n");
-						fprintf(stderr, "MOVING FILE: %s\n", dir->files[j].fname);
-						int freePoint = findEnd();
-						long newLocation = FILE_START+(freePoint*BLOCK_SIZE);
-						int blocks = (int)(retSize/BLOCK_SIZE);
-
-						int startToLook = ((startBlock-FILE_START)/BLOCK_SIZE);
-						//update the map with free spaces got from moving this file
-						for(i = -1; i<blocks; i++){
-							updateMap(startToLook+(i+1), 0);
-							fprintf(stderr, "MAP UPDATE : INDEX FREED: %d\n", startToLook+(i+1));
-						}
-						dir->files[j].nStartBlock = newLocation;
-						fprintf(stderr, "NEW LOCATION: %d\n", newLocation);
-						for(i = -1; i<blocks; i++){
-
-							cs1550_disk_block * block = readDataToBlock(startBlock);
-							writeBlockToFile(block, newLocation);
-							updateMap(freePoint+(i+1), 1);
-							fprintf(stderr, "MAP UPDATED AT WITH 1 :  %d\n", freePoint+(i+1));
-							startBlock = startBlock + BLOCK_SIZE;
-							newLocation = newLocation + BLOCK_SIZE;
-
-						}
-						updateDir(dirOff, dir);
-						return 1;
+#define MAX_WRITE 4096
 
-
-				}
-			}
+/*
+ *Makes blocks oldBlocks to newBlocks of the plain file fileIndex of the
+ *directory at dirOff free, so the write path can grow it into them.
+ *Files in the way are moved after the last used block. If something in
+ *the way can't be moved (a block the snapshot has, the middle of another
+ *file, the end of the disk) the file moves there itself instead. Returns
+ *the file's start, or -ENOSPC if it doesn't fit anywhere.
+ */
+static long makeRoom(long dirOff, int fileIndex, int oldBlocks, int newBlocks){
+	cs1550_directory_entry *dir = readDir(dirOff);
+	long start = dir->files[fileIndex].nStartBlock;
+	int first = BLOCK_INDEX(start);
+	int b;
+
+	free(dir);
+	for(b = first+oldBlocks; b<first+newBlocks; b++){
+		if(b<MAX_BLOCK_FOR_FILE&&findContigBlocks(b)==1){
+			continue;
 		}
-		return -1;
+		if(b<MAX_BLOCK_FOR_FILE&&!isPinned(b)
+			&&moveFiles(FILE_START+((long)b*BLOCK_SIZE), first+newBlocks)==1&&findContigBlocks(b)==1){
+			continue;
+		}
+		int to = findEnd();
+		if(to==-1||to+newBlocks>MAX_BLOCK_FOR_FILE){
+			return -ENOSPC;
+		}
+		TRACE(TRACE_DEBUG, "MOVING MYSELF FROM %d TO %d", first, to);
+		relocateBlocks(first, to, oldBlocks);
+		start = FILE_START+((long)to*BLOCK_SIZE);
+		dir = readDir(dirOff);
+		dir->files[fileIndex].nStartBlock = start;
+		updateDir(dirOff, dir);
+		free(dir);
+		STAT_ADD(stats.relocations, 1);
+		break;
+	}
+	return start;
 }
 
 /*
- *This function writes buffer data to a block.
+ *Fills dst with the block at offset of .disk, with map byte mark, as it
+ *is before the write path patches it: zeros if it is new or a hole, the
+ *copy in rmwBlock if it is still there. Returns -1 if it doesn't match
+ *its checksum.
  */
-static int writeBufToBlock(int bufPos, cs1550_disk_block * block, const char * buf){
-	int i;
-	for(i = 0; i<512; i++){
-		block->data[i] = buf[bufPos];
-		bufPos++;
+static int patchBlock(char *dst, off_t offset, unsigned char mark){
+	if(mark!=1){
+		memset(dst, 0, BLOCK_SIZE);
+		return 0;
 	}
-
-	return bufPos;
+	if(rmwOffset[RMW_SLOT(offset)]==offset){
+		memcpy(dst, rmwBlock[RMW_SLOT(offset)], BLOCK_SIZE);
+		STAT_ADD(stats.rmwCached, 1);
+		return 0;
+	}
+	STAT_ADD(stats.rmwReads, 1);
+	diskRead(dst, BLOCK_SIZE, offset);
+	return verifyBlocks(dst, BLOCK_SIZE, offset);
 }
 
 /*
- *This function finds contiguous blocks from some index, for writing.
+ *Writes size bytes from buf at offset of the plain file at fileStart,
+ *which had oldBlocks blocks before makeRoom. Whole blocks come straight
+ *from buf, a first or last block the write only covers part of is
+ *patched, and it all goes out in one diskWrite. The blocks written are
+ *marked in use, and the ones skipped between the old end and the write
+ *are marked as holes. Returns 0, or -EIO.
  */
-static int findContigBlocks(int index){
-	map * data = (map *)malloc(sizeof(map));
-	FILE * fp = fopen(".disk", "rb+");
-	fseek(fp, -sizeof(map), SEEK_END);
-	fread(data, sizeof(map), 1, fp);
-	if(data->blockmap[index]==0){
-		fclose(fp);
-		return 1;
+static int writeSpan(const char *buf, size_t size, off_t offset, long fileStart, int oldBlocks){
+	int first = BLOCK_INDEX(fileStart);
+	long head = offset/BLOCK_SIZE;
+	long tail = (offset+size-1)/BLOCK_SIZE;
+	int count = tail-head+1;
+	long at = fileStart+((long)head*BLOCK_SIZE);
+	long last = at+((long)(count-1)*BLOCK_SIZE);
+	int partialHead = offset%BLOCK_SIZE!=0;
+	int partialTail = (offset+size)%BLOCK_SIZE!=0;
+	unsigned char *marks = (unsigned char *)calloc(count, 1);
+	char *span = (char *)malloc(count*BLOCK_SIZE);
+	int bad = 0;
+	int b;
+
+	//blocks past the old end have no data yet
+	if(head<oldBlocks){
+		readMapRange(first+head, (tail<oldBlocks ? count : oldBlocks-head), marks);
+	}
+	if(partialHead){
+		bad = patchBlock(span, at, marks[0]);
 	}
+	if(!bad&&partialTail&&(count>1||!partialHead)){
+		bad = patchBlock(span+(count-1)*BLOCK_SIZE, last, marks[count-1]);
+	}
+	if(bad){
+		free(span);
+		free(marks);
+		return -EIO;
+	}
+	memcpy(span+(offset%BLOCK_SIZE), buf, size);
+	diskWrite(span, count*BLOCK_SIZE, at);
+	if(partialTail){
+		memcpy(rmwBlock[RMW_SLOT(last)], span+(count-1)*BLOCK_SIZE, BLOCK_SIZE);
+		rmwOffset[RMW_SLOT(last)] = last;
+	}
+	free(span);
 
-	return -1;
-	fclose(fp);
+	if(head>oldBlocks){
+		updateMapRange(first+oldBlocks, head-oldBlocks, MAP_HOLE);
+		STAT_ADD(stats.holeBlocks, head-oldBlocks);
+	}
+	for(b = 0; b<count&&marks[b]==1; b++){
+	}
+	if(b<count){
+		updateMapRange(first+head, count, 1);
+	}
+	free(marks);
+	return 0;
 }
 
-/*
- *
- */
- static int printBitMap(){
-	 map * data = (map *)malloc(sizeof(map));
-	 FILE * fp = fopen(".disk", "rb+");
-	 fseek(fp, -sizeof(map), SEEK_END);
-	 fread(data, sizeof(map), 1, fp);
-	 int i;
-	 for(i = 0; i<50; i++){
-		 fprintf(stderr,"BIT[%d] = %d\n", i, data->blockmap[i]);
-	 }
-
-	 fclose(fp);
- }
 /*
  * Write size bytes from buf into file starting from offset
  *
@@ -846,478 +4942,106 @@ static int findContigBlocks(int index){
 static int cs1550_write(const char *path, const char *buf, size_t size,
 			  off_t offset, struct fuse_file_info *fi)
 {
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
-
-	fprintf(stderr,"OFSSET IN BEGINNING %d\n", offset);
-	char directory[8];
-	char  filename[8];
-	char extension[3];
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	struct cs1550_directory_entry* dir = fileExist(path);
+	int dirIndex;
+	int fileIndex;
 	int i;
+
+	TRACE(TRACE_DEBUG, "OFSSET IN BEGINNING %lld", (long long)offset);
 	//check to make sure path exists
-	if(dir==NULL){
-		fprintf(stderr, "NULL DIR: %s\n", path);
+	if(fileSlots(path, fi, &dirIndex, &fileIndex)!=0){
+		TRACE(TRACE_INFO, "NULL DIR: %s", path);
 		return -1;
 	}
 	//check that size is > 0
 	if(size<1){
-		fprintf(stderr, "SIZE LESS THAN 0s: %s\n", path);
+		TRACE(TRACE_DEBUG, "SIZE LESS THAN 0s: %s", path);
 		return -1;
 	}
+	//the end of the write has to fit in a file, checked before any of it is
+	//narrowed to block counts, which a far offset would overflow
+	if(offset<0){
+		return -EINVAL;
+	}
+	if(offset>(off_t)MAX_BLOCK_FOR_FILE*BLOCK_SIZE-(off_t)size){
+		return -EFBIG;
+	}
 
-	if(dir!=NULL){
-		for(i = 0; i<dir->nFiles; i++){
-				char *name = dir->files[i].fname;
-				int fileFound;
-				if(strcmp(name, filename)==0){
-					int fileSize = dir->files[i].fsize;
-					int fileStart = dir->files[i].nStartBlock;
-					//check that offset is <= to the file size
-					fileFound =  i;
-					fprintf("FILE SIZE = %d\n", fileSize);
-					if(offset<=fileSize){
-
-						//append
-						if((offset!=0)&&offset==fileSize){
-							fprintf(stderr,"THIS AN APEND\n");
-							fprintf(stderr, "SIZE = %d\n", size);
-							if(size>512){
-								fprintf(stderr, "MAY NEED NEW BLOCK : %d\n", size);
-								int blocksOccu;
-								int blocksNeededNow;
-								int bufRet = 0;
-								int bufPos = 0;
-								if((fileSize%BLOCK_SIZE)!=0){
-									blocksOccu = (fileSize/BLOCK_SIZE)+1;
-									blocksNeededNow = (size/BLOCK_SIZE)+1;
-									fprintf(stderr, "NOT JUST MAKING A BIG FILE!\n");
-								}
-								else{
-									blocksNeededNow = (size/BLOCK_SIZE);
-									blocksOccu = (fileSize/BLOCK_SIZE);
-									fprintf(stderr, "JUST MAKING A BIG FILE, THIS APENDING 4096+ BYTES AT THE END\n");
-								}
-
-								int blocksNeeded = blocksNeededNow;
-								int blocksFound = 0;
-								int blockTaken = 0;
-								int spaceOccu = blocksOccu*BLOCK_SIZE;
-								int startToLook = (((fileStart + spaceOccu)-FILE_START)/BLOCK_SIZE);
-
-								fprintf(stderr, "START LOOKING FOR FREE BLOCKS FROM HERE = %d\n", startToLook);
-								int j = 0;
-								for(j = 0; j<blocksNeeded; j++){
-									if((startToLook+j)==MAX_FILES_SYSTEM){
-										return -EFBIG;
-									}
-									if(findContigBlocks(startToLook+j)==1){
-										blocksFound++;
-									}
-									else{
-										blockTaken = j+startToLook;
-										break;
-									}
-								}
-								//If I was able to find, the number of blocks needed
-								//to write this size bytes to file.
-								if(blocksFound==blocksNeeded){
-									fprintf(stderr, "NO MOVING REQUIRED\n");
-									int bufPos = 0;
-									int bufRet = 0;
-									int filePos = fileStart+spaceOccu;
-									int blocksWrite = blocksNeeded;
-									//since I can only write total of 8 blocks 4096 bytes every write!
-									if(blocksWrite>8){
-										blocksWrite = 8;
-									}
-									fprintf(stderr, "BLOCKS NEEDED %d\n", blocksNeeded);
-									cs1550_disk_block *block = (cs1550_disk_block * )malloc(sizeof(cs1550_disk_block));
-									int startIndex = (((fileStart+spaceOccu)-FILE_START)/BLOCK_SIZE);
-
-									for(j = 0; j<blocksWrite; j++){
-										fprintf(stderr, "WRITING BLOCK NO: %d \n", j);
-										fprintf(stderr, "WRITING AT BUF POS: %d \n", bufRet);
-										bufRet = writeBufToBlock(bufPos, block, buf);
-										bufPos = bufRet;
-										writeBlockToFile(block, filePos+(j*BLOCK_SIZE));
-										updateMap((startIndex+j), 1);
-										fprintf(stderr, "MAP UPDATED AT %d\n", (startIndex+j));
-
-									}
-
-									int dirStart = findOffset(directory);
-									cs1550_directory_entry *entry = readDir(dirStart);
-									entry->files[fileFound].fsize = size+fileSize;
-									entry->files[fileFound].nStartBlock = fileStart;
-									updateDir(dirStart, entry);
-									free(block);
-									printBitMap();
-									return size;
-								}
-								else{
-									int filePos = fileStart+spaceOccu;
-									fprintf(stderr, "MOVING REQUIRED");
-									int ret;
-									blocksFound = 0;
-									while(blocksNeeded!=blocksFound){
-										fprintf(stderr, "BLOCKS NEEDED : %d\n", blocksNeeded);
-										fprintf(stderr, "BLOCKS FOUND: %d\n", blocksFound);
-
-										fprintf(stderr, "INDEX AT WHICH BLOCK IS TAKEN : %d\n", blockTaken);
-										long loc = FILE_START+(blockTaken*BLOCK_SIZE);
-										ret = moveFiles(loc, fileSize);
-										//if ret==-1 it means that I already occupy that block(no file exists there)
-										//so I go ahead and write it.
-										if(ret==-1){
-											cs1550_disk_block * block = (cs1550_disk_block*)malloc(sizeof(cs1550_disk_block));
-
-											fprintf(stderr, "I OCCUPY! INDEX = %d\n", startToLook);
-											bufRet = writeBufToBlock(bufPos, block, buf);
-											bufPos = bufRet;
-											writeBlockToFile(block, filePos);
-											updateMap((startToLook), 1);
-											fprintf(stderr, "BIT MAP UPDATED AT INDEX %d WTIH 1\n", startToLook);
-											spaceOccu = spaceOccu+512;
-											blocksNeeded--;
-											startToLook++;
-											free(block);
-										}
-										blocksFound = 0;
-										for(j = 0; j<blocksNeeded; j++){
-											if((startToLook+j)==MAX_FILES_SYSTEM){
-												return -EFBIG;
-											}
-											if(findContigBlocks(startToLook+j)==1){
-												blocksFound++;
-											}
-											else{
-												blockTaken = j+startToLook;
-												break;
-											}
-										}
-									}
-									//if blocks needed ==0 means that I've written all data that I needed to, this write.
-									if(blocksNeeded==0){
-										fprintf(stderr, "WROTE ALL BLOCKS I NEEDED TO\n");
-										int dirStart = findOffset(directory);
-										cs1550_directory_entry *entry = readDir(dirStart);
-										entry->files[fileFound].fsize = size+fileSize;
-										entry->files[fileFound].nStartBlock = fileStart;
-										updateDir(dirStart, entry);
-										printBitMap();
-										return size;
-									}
-									//I moved enough blocks to be able to write.
-									if(ret==1){
-										fprintf(stderr, "MOVED ENOUGH BLOCKS TO WRITE MY BLOCK\n");
-										int k;
-										int blocksWrite = blocksNeeded;
-										if(blocksWrite>8){
-											blocksWrite = 8;
-										}
-										int filePos = fileStart+spaceOccu;
-										bufPos = 0;
-										bufRet = 0;
-										int startIndex = (((fileStart+spaceOccu)-FILE_START)/BLOCK_SIZE);
-
-
-										fprintf(stderr,"START INDEX = %d\n", startIndex);
-										fprintf(stderr, "BLOCKS TO WRITE = %d\n", blocksWrite);
-										cs1550_disk_block * block = (cs1550_disk_block *)malloc(sizeof(cs1550_disk_block));
-										for(k = 0; k<blocksWrite; k++){
-											bufRet = writeBufToBlock(bufPos, block, buf);
-											bufPos = bufRet;
-											writeBlockToFile(block, filePos+(k*BLOCK_SIZE));
-											updateMap((startIndex+k), 1);
-											fprintf(stderr, "BIT MAP UPDATED AT INDEX %d WITH 1\n", startIndex+k);
-
-										}
-										int dirStart = findOffset(directory);
-										cs1550_directory_entry *entry = readDir(dirStart);
-										entry->files[fileFound].fsize = size+fileSize;
-										entry->files[fileFound].nStartBlock = fileStart;
-										updateDir(dirStart, entry);
-										free(block);
-										printBitMap();
-										return size;
-									}
-
-								}
-
-							}
-							//I'm apending a file that is smaller, than a block. And adding data that will
-							//keep it smaller than a block. No moving required.
-							else if(fileSize<512&&((fileSize+size)<512)){
-									cs1550_disk_block *block = (cs1550_disk_block*)malloc(sizeof(cs1550_disk_block));
-									fprintf(stderr, "WILL NOT NEED NEW BLOCK, SINCE WRITING SMALL FILE: %d\n", (fileSize+size));
-									fprintf(stderr, "OFFSET : %d\n", offset);
-									//writeBufToBlock(0, block, buf);
-								//	writeBlockToFile(block, fileStart+offset);
-								  writeDataToFile(buf, size, fileStart, offset);
-									int sizeIncrease = fileSize+size;
-									fprintf(stderr, "FILE SIZE BEFORE WRITE : %d\n", dir->files[i].fsize);
-									dir->files[i].fsize = sizeIncrease;
-									fprintf(stderr, "FILE SIZE AFTER WRITE : %d\n", dir->files[i].fsize);
-									int dirStart = findOffset(directory);
-									updateDir(dirStart, dir);
-									free(block);
-									printBitMap();
-									return size;
-							}
-							//writing the smallest possible part of an append. Probably last block of a file.
-							else if(size<512&&fileSize>512){
-								cs1550_disk_block *block = (cs1550_disk_block*)malloc(sizeof(cs1550_disk_block));
-								int blocksBet = (fileStart-FILE_START)/512;
-								int blocksOccu = fileSize/BLOCK_SIZE;
-								int indexToWrite = blocksBet+blocksOccu;
-								fprintf(stderr, "INDEX TO WRITE = %d", indexToWrite);
-								if((indexToWrite)==MAX_FILES_SYSTEM){
-									return -EFBIG;
-								}
-								if(findContigBlocks(indexToWrite)==1){
-									fprintf(stderr, "WRITING SMALLEST BLOCK OF APEND\n");
-									fprintf(stderr, "OFFSET : %d\n", offset);
-									writeBufToBlock(0, block, buf);
-									writeBlockToFile(block, fileStart+offset);
-									int sizeIncrease = fileSize+size;
-									fprintf(stderr, "FILE SIZE BEFORE WRITE : %d\n", dir->files[i].fsize);
-									dir->files[i].fsize = sizeIncrease;
-									fprintf(stderr, "FILE SIZE AFTER WRITE : %d\n", dir->files[i].fsize);
-									updateMap(indexToWrite,1);
-									int dirStart = findOffset(directory);
-									cs1550_directory_entry *entry = readDir(dirStart);
-									entry->files[fileFound].fsize = size+fileSize;
-									entry->files[fileFound].nStartBlock = fileStart;
-									updateDir(dirStart, entry);
-									free(block);
-									printBitMap();
-									return size;
-								}
-								else{
-									int loc = (indexToWrite*BLOCK_SIZE)+FILE_START;
-									int ret = moveFiles(loc, 0);
-									if(ret==-1){
-										fprintf(stderr, "I OCCUPY THIS BLOCK\n");
-										writeDataToFile(buf, size, fileStart, offset);
-										int dirStart = findOffset(directory);
-										cs1550_directory_entry *entry = readDir(dirStart);
-										entry->files[fileFound].fsize = size+fileSize;
-										entry->files[fileFound].nStartBlock = fileStart;
-										updateDir(dirStart, entry);
-										free(block);
-										printBitMap();
-										return size;
-									}
-									else{
-											fprintf(stderr, "I GUESS THIS IS NOT THE PROBELM\n");
-									}
-									fprintf(stderr, "WRITING SMALLEST BLOCK OF APEND\n");
-									fprintf(stderr, "OFFSET : %d\n", offset);
-									writeBufToBlock(0, block, buf);
-									writeBlockToFile(block, loc);
-									updateMap(indexToWrite,1);
-									int sizeIncrease = fileSize+size;
-									fprintf(stderr, "FILE SIZE BEFORE WRITE : %d\n", dir->files[i].fsize);
-									dir->files[i].fsize = sizeIncrease;
-									fprintf(stderr, "FILE SIZE AFTER WRITE : %d\n", dir->files[i].fsize);
-									int dirStart = findOffset(directory);
-									cs1550_directory_entry *entry = readDir(dirStart);
-									entry->files[fileFound].fsize = size+fileSize;
-									entry->files[fileFound].nStartBlock = fileStart;
-									updateDir(dirStart, entry);
-									free(block);
-									printBitMap();
-									return size;
-
-								}
-
-							}
-						}
-						//This is not an apend. Meaning either I am writing to a new file, or I opened this in nano
-						//and am writing new stuff from there.
-						else{
-							fprintf(stderr, "NOT APEND");
-							fprintf(stderr, "SIZE = %d\n", size);
-							if(size>512){
-								int blocksOccu;
-								int blocksNeeded;
-								if(size%512==0){
-										blocksNeeded = ((size/BLOCK_SIZE));
-								}
-								else{
-										blocksNeeded = ((size/BLOCK_SIZE))+1;
-								}
-								if(fileSize%512==0){
-										blocksOccu = (fileSize/BLOCK_SIZE);
-								}
-								else{
-										blocksOccu = (fileSize/BLOCK_SIZE)+1;
-								}
-								if(fileSize==0){
-									fprintf(stderr, "NEW WRITE : \n");
-									blocksOccu = 1;
-								}
-								blocksNeeded = ((size/BLOCK_SIZE)-blocksOccu)+1;
-								//if blocks needed come out to be negative, I probably don't needed
-								//new blocks. Nanoing a file that is already big enough.
-								if(blocksNeeded<0){
-									blocksNeeded = 0;
-								}
-								int blocksFound = 0;
-								int blockTaken = 0;
-								int spaceOccu = blocksOccu*BLOCK_SIZE;
-								int startToLook = (((fileStart+spaceOccu)-FILE_START)/512);
-
-								fprintf(stderr, "START TO LOOK AT INDEX: %d\n", startToLook);
-								fprintf(stderr, "SPACE OCCUPIED BY FILE: %d\n", spaceOccu);
-								//check if there are contiguous blocks
-								int j = 0;
-								for(j = 0; j<blocksNeeded; j++){
-									if((startToLook)==MAX_FILES_SYSTEM){
-										return -EFBIG;
-									}
-									if(findContigBlocks(startToLook+j)==1){
-										blocksFound++;
-									}
-									else{
-										blockTaken = j+startToLook;
-										break;
-									}
-								}
-								//if I found enough blocks to write, write. No moving of blocks is required.
-								if(blocksFound==blocksNeeded){
-									fprintf(stderr, "NO MOVING REQUIRED\n");
-									int bufPos = 0;
-									int bufRet = 0;
-									int filePos = fileStart;
-									int blocksWrite = blocksNeeded+blocksOccu;
-									if(blocksWrite>8){
-										blocksWrite = 8;
-									}
-									cs1550_disk_block *block = (cs1550_disk_block * )malloc(sizeof(cs1550_disk_block));
-									int startIndex = ((fileStart-FILE_START)/BLOCK_SIZE);
-									if((fileStart-FILE_START)==0){
-										startIndex = 0;
-									}
-									for(j = 0; j<blocksWrite; j++){
-										bufRet = writeBufToBlock(bufPos, block, buf);
-										bufPos = bufRet;
-										writeBlockToFile(block, filePos+(j*BLOCK_SIZE));
-										updateMap((startIndex+j), 1);
-										fprintf(stderr, "MAP UPDATED AT %d\n", (startIndex+j));
-									}
-
-									dir->files[fileFound].fsize = size;
-									dir->files[fileFound].nStartBlock = fileStart;
-									int dirStart = findOffset(directory);
-									updateDir(dirStart, dir);
-									free(block);
-									fprintf(stderr, "SIZE when apending! %d\n", size);
-									printBitMap();
-									return size;
-								}
-								//otherwise moving is requred. Move stuff, so file can fit.
-								else{
-									fprintf(stderr, "MOVING REQUIRED");
-									int ret;
-									blocksFound = 0;
-									while(blocksNeeded!=blocksFound){
-										fprintf(stderr, "BLOCKS NEEDED : %d\n", blocksNeeded);
-										fprintf(stderr, "BLOCKS FOUND : %d\n", blocksFound);
-										fprintf(stderr, "BLOCK TAKE AT INDEX : %d\n", blockTaken);
-
-										long loc = FILE_START+(blockTaken*BLOCK_SIZE);
-										ret = moveFiles(loc, fileSize);
-										blocksFound = 0;
-										for(j = 0; j<blocksNeeded; j++){
-											if((startToLook+j)==MAX_FILES_SYSTEM){
-												return -EFBIG;
-											}
-											if(findContigBlocks(startToLook+j)==1){
-												blocksFound++;
-											}
-											else{
-												blockTaken = j+startToLook;
-												break;
-											}
-										}
-									}
-									//
-									if(ret==1){
-										fprintf(stderr, "MOVED ENOUGH BLOCKS TO WRITE MY BLOCK\n");
-										int k;
-										int blocksWrite = blocksNeeded+blocksOccu;
-										if(blocksWrite>8){
-											blocksWrite = 8;
-										}
-										int filePos = fileStart;
-										int bufPos = 0;
-										int bufRet = 0;
-										int startIndex = ((fileStart-FILE_START)/BLOCK_SIZE);
-										if((fileStart-FILE_START)==0){
-											startIndex = 0;
-										}
-										fprintf(stderr,"START WRTING FROM BEGINING OF FILE = %d\n", startIndex);
-										fprintf(stderr, "BLOCKS TO WRITE = %d\n", blocksWrite);
-										cs1550_disk_block * block = (cs1550_disk_block *)malloc(sizeof(cs1550_disk_block));
-										for(k = 0; k<blocksWrite; k++){
-											bufRet = writeBufToBlock(bufPos, block, buf);
-											bufPos = bufRet;
-											writeBlockToFile(block, filePos+(k*BLOCK_SIZE));
-											updateMap((startIndex+k), 1);
-											fprintf(stderr, "MAP UPDATED AT: %d\n", startIndex+k);
-
-										}
-										int dirStart = findOffset(directory);
-										cs1550_directory_entry *entry = readDir(dirStart);
-										entry->files[fileFound].fsize = size;
-										entry->files[fileFound].nStartBlock = fileStart;
-										updateDir(dirStart, entry);
-										free(block);
-										printBitMap();
-										return size;
-									}
-
-								}
-							}
-							//the file was small enough that we don't need to worry about moving things.
-							else if(fileSize<=512&&((fileSize+size)<=512)){
-								cs1550_disk_block *block = (cs1550_disk_block*)malloc(sizeof(cs1550_disk_block));
-								fprintf(stderr, "WILL NOT NEED NEW BLOCK: %d\n", (fileSize+size));
-								writeBufToBlock(0, block, buf);
-								writeBlockToFile(block, fileStart);
-								//writeDataToFile(buf, size, fileStart, offset);
-								fprintf(stderr, "OFFSET : %d\n", offset);
-								dir->files[fileFound].fsize = size;
-								int dirStart = findOffset(directory);
-								updateDir(dirStart, dir);
-								printBitMap();
-								return size;
-							}
-
-						}
-
-					}
-					else{
-						return -EFBIG;
-					}
-				}
+	long dirStart = DIR_OFFSET(dirIndex);
+	struct cs1550_directory_entry* dir = readDir(dirStart);
+	i = fileIndex;
+	size_t fileSize = dir->files[i].fsize;
+	long fileStart = dir->files[i].nStartBlock;
+	unsigned char kind = mapEntry(BLOCK_INDEX(fileStart));
+	//a small file that still fits in its slot, nothing to allocate or move,
+	//unless the snapshot has the block
+	if(kind==MAP_PACKED&&offset+size<=SMALL_FILE_MAX&&!isPinned(BLOCK_INDEX(fileStart))){
+		writeDataToFile(buf, size, fileStart, offset);
+		if(offset+size>fileSize){
+			dir->files[i].fsize = offset+size;
+			updateDir(dirStart, dir);
 		}
+		free(dir);
+		return size;
 	}
-	else{
-		return -1;
+	free(dir);
+	//anything else has to be made plain blocks of its own first
+	if(kind>1){
+		long moved;
+		if(kind==MAP_PACKED){
+			moved = promoteSmallFile(dirStart, i);
+		}
+		else if(kind==MAP_COMPRESSED){
+			moved = expandFile(dirStart, i);
+		}
+		else{
+			moved = unshareFile(dirStart, i);
+		}
+		if(moved<0){
+			return moved;
+		}
+		fileStart = moved;
 	}
 
-
+	off_t newSize = (offset+(off_t)size>(off_t)fileSize) ? offset+(off_t)size : (off_t)fileSize;
+	long oldBlocks = fileBlocks(fileSize);
+	long newBlocks = fileBlocks(newSize);
+	long head = offset/BLOCK_SIZE;
+	long tail = (offset+size-1)/BLOCK_SIZE;
+	TRACE(TRACE_DEBUG, "FILE SIZE = %zu", fileSize);
+	if(newBlocks>MAX_BLOCK_FOR_FILE){
+		return -EFBIG;
+	}
+	//blocks the snapshot has are copied before they change
+	if(head<oldBlocks&&rangePinned(BLOCK_INDEX(fileStart)+head, (tail<oldBlocks ? tail+1 : oldBlocks)-head)){
+		long moved = cowFile(dirStart, i);
+		if(moved<0){
+			return moved;
+		}
+		fileStart = moved;
+	}
+	if(newBlocks>oldBlocks){
+		long moved = makeRoom(dirStart, i, oldBlocks, newBlocks);
+		if(moved<0){
+			return moved;
+		}
+		fileStart = moved;
+	}
+	if(writeSpan(buf, size, offset, fileStart, oldBlocks)!=0){
+		return -EIO;
+	}
+	if(newSize>(off_t)fileSize){
+		dir = readDir(dirStart);
+		dir->files[i].fsize = newSize;
+		updateDir(dirStart, dir);
+		free(dir);
+	}
+	printBitMap();
+	return size;
 }
 
 /******************************************************************************
  *
- *  DO NOT MODIFY ANYTHING BELOW THIS LINE
+ *  The remaining handlers, the timed wrappers, the operation table and main
  *
  *****************************************************************************/
 
@@ -1343,14 +5067,35 @@ static int cs1550_truncate(const char *path, off_t size)
  */
 static int cs1550_open(const char *path, struct fuse_file_info *fi)
 {
-	(void) path;
-	(void) fi;
-    /*
-        //if we can't find the desired file, return an error
-        return -ENOENT;
-    */
+	int dirIndex;
+	int fileIndex;
+	int ret;
+
+	if(strcmp(path, STATS_PATH)==0){
+		if((fi->flags & O_ACCMODE)!=O_RDONLY){
+			return -EACCES;
+		}
+		fi->direct_io = 1;
+		return 0;
+	}
+	//the snapshot is read by path, fh stays 0
+	if(isSnapPath(path)){
+		if((fi->flags & O_ACCMODE)!=O_RDONLY){
+			return -EROFS;
+		}
+		ret = snapResolve(path+strlen(SNAP_DIR), &dirIndex, &fileIndex);
+		if(ret==0&&fileIndex==-1){
+			ret = -EISDIR;
+		}
+		return ret;
+	}
+	ret = resolveFile(path, &dirIndex, &fileIndex);
 
-    //It's not really necessary for this project to anything in open
+	//if we can't find the desired file, return an error
+	if(ret!=0){
+		return ret;
+	}
+	fi->fh = FH_MAKE(dirIndex, fileIndex, slotGeneration(dirIndex, fileIndex));
 
     /* We're not going to worry about permissions for this project, but
 	   if we were and we don't have them to the file we should return an error
@@ -1369,30 +5114,340 @@ static int cs1550_open(const char *path, struct fuse_file_info *fi)
  */
 static int cs1550_flush (const char *path , struct fuse_file_info *fi)
 {
+	int dirIndex;
+	int fileIndex;
+
+	if((config.compress||config.dedup)&&fileSlots(path, fi, &dirIndex, &fileIndex)==0){
+		//a file that is now shared is left as it is
+		if(!(config.dedup&&dedupFile(DIR_OFFSET(dirIndex), fileIndex))&&config.compress){
+			compressFile(DIR_OFFSET(dirIndex), fileIndex);
+		}
+	}
+
+	return 0; //success!
+}
+
+/*
+ * Makes everything written so far durable, not just the file's blocks,
+ * since the image is one unit. With -o ram that means a checkpoint.
+ */
+static int cs1550_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	int i;
 	(void) path;
+	(void) datasync;
 	(void) fi;
 
-	return 0; //success!
+	flushCreates();
+	if(ramImage!=NULL){
+		return checkpointImage()==0 ? 0 : -EIO;
+	}
+	for(i = 0; i<nDisks; i++){
+		if(fdatasync(disks[i].fd)!=0){
+			return -EIO;
+		}
+	}
+	if(crcFd!=-1&&fdatasync(crcFd)!=0){
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Handles the ioctls in cs1550_ioctl.h on an open file.
+ */
+static int cs1550_ioctl(const char *path, int cmd, void *arg,
+			  struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+	(void) arg;
+	(void) flags;
+	int dirIndex;
+	int fileIndex;
+
+	if(cmd!=(int)CS1550_IOC_CLONE){
+		return -ENOTTY;
+	}
+	if(fileSlots(path, fi, &dirIndex, &fileIndex)!=0){
+		return -ENOENT;
+	}
+	struct cs1550_clone *req = (struct cs1550_clone *)data;
+	if(memchr(req->dest, 0, sizeof(req->dest))==NULL){
+		return -ENAMETOOLONG;
+	}
+	return cloneFile(dirIndex, fileIndex, req->dest);
+}
+
+/*
+ * Called once the filesystem is mounted. Threads have to be started here
+ * rather than in main, which runs before fuse_main daemonizes.
+ */
+static void *cs1550_init(struct fuse_conn_info *conn)
+{
+	(void) conn;
+
+	startStripeWorkers();
+	pthread_once(&indexOnce, loadIndex);
+	if(!indexLoaded&&pthread_create(&warmTid, NULL, warmThread, NULL)==0){
+		warmRunning = 1;
+	}
+	if(config.defrag&&config.defragRate>0){
+		if(pthread_create(&defragTid, NULL, defragThread, NULL)==0){
+			defragRunning = 1;
+		}
+	}
+	if(ramImage!=NULL&&config.checkpoint>0){
+		if(pthread_create(&checkpointTid, NULL, checkpointThread, NULL)==0){
+			checkpointRunning = 1;
+		}
+	}
+	if(config.createBatch>0&&pthread_create(&createTid, NULL, createThread, NULL)==0){
+		createRunning = 1;
+	}
+	return NULL;
+}
+
+/*
+ * Called when the filesystem is unmounted.
+ */
+static void cs1550_destroy(void *private_data)
+{
+	(void) private_data;
+
+	if(defragRunning){
+		defragStop = 1;
+		pthread_join(defragTid, NULL);
+		defragRunning = 0;
+	}
+	if(checkpointRunning){
+		checkpointStop = 1;
+		pthread_join(checkpointTid, NULL);
+		checkpointRunning = 0;
+	}
+	if(createRunning){
+		createStop = 1;
+		pthread_join(createTid, NULL);
+		createRunning = 0;
+	}
+	if(warmRunning){
+		pthread_join(warmTid, NULL);
+		warmRunning = 0;
+	}
+	//nothing is left to change the image, write it out a last time
+	flushCreates();
+	if(checkpointImage()==0){
+		saveIndex();
+	}
+	stopStripeWorkers();
+	freeRings();
+	dumpTrace(STDERR_FILENO);
+}
+
+/*
+ * The kernel calls these, which take fsLock, hand the call to the real
+ * implementation and count and time it into stats.
+ */
+static int timed_getattr(const char *path, struct stat *stbuf)
+{
+	unsigned long long start = nowNs();
+	int ret;
+
+	pthread_rwlock_rdlock(&fsLock);
+	ret = cs1550_getattr(path, stbuf);
+	pthread_rwlock_unlock(&fsLock);
+	recordOp(OP_GETATTR, start, ret, 0);
+	return ret;
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	unsigned long long start = nowNs();
+	int ret;
+
+	pthread_rwlock_rdlock(&fsLock);
+	ret = cs1550_readdir(path, buf, filler, offset, fi);
+	pthread_rwlock_unlock(&fsLock);
+	recordOp(OP_READDIR, start, ret, 0);
+	return ret;
+}
+
+static int timed_mkdir(const char *path, mode_t mode)
+{
+	unsigned long long start = nowNs();
+	int ret;
+
+	pthread_rwlock_wrlock(&fsLock);
+	ret = cs1550_mkdir(path, mode);
+	pthread_rwlock_unlock(&fsLock);
+	recordOp(OP_MKDIR, start, ret, 0);
+	return ret;
+}
+
+static int timed_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	unsigned long long start = nowNs();
+	int ret;
+
+	pthread_rwlock_wrlock(&fsLock);
+	ret = cs1550_mknod(path, mode, dev);
+	pthread_rwlock_unlock(&fsLock);
+	recordOp(OP_MKNOD, start, ret, 0);
+	return ret;
 }
 
+static int timed_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	unsigned long long start = nowNs();
+	int ret;
+
+	pthread_rwlock_rdlock(&fsLock);
+	ret = cs1550_read(path, buf, size, offset, fi);
+	pthread_rwlock_unlock(&fsLock);
+	recordOp(OP_READ, start, ret, (ret>0) ? ret : 0);
+	return ret;
+}
+
+static int timed_write(const char *path, const char *buf, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	unsigned long long start = nowNs();
+	int ret;
+
+	pthread_rwlock_wrlock(&fsLock);
+	ret = cs1550_write(path, buf, size, offset, fi);
+	pthread_rwlock_unlock(&fsLock);
+	recordOp(OP_WRITE, start, ret, (ret>0) ? ret : 0);
+	return ret;
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+	unsigned long long start = nowNs();
+	int ret;
+
+	pthread_rwlock_rdlock(&fsLock);
+	ret = cs1550_open(path, fi);
+	pthread_rwlock_unlock(&fsLock);
+	recordOp(OP_OPEN, start, ret, 0);
+	return ret;
+}
+
+static int timed_flush(const char *path, struct fuse_file_info *fi)
+{
+	unsigned long long start = nowNs();
+	int ret;
+
+	//flush compresses or dedups the file with -o compress or -o dedup
+	if(config.compress||config.dedup){
+		pthread_rwlock_wrlock(&fsLock);
+	}
+	else{
+		pthread_rwlock_rdlock(&fsLock);
+	}
+	ret = cs1550_flush(path, fi);
+	pthread_rwlock_unlock(&fsLock);
+	recordOp(OP_FLUSH, start, ret, 0);
+	return ret;
+}
+
+static int timed_ioctl(const char *path, int cmd, void *arg,
+			  struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+	unsigned long long start = nowNs();
+	int ret;
+
+	pthread_rwlock_wrlock(&fsLock);
+	ret = cs1550_ioctl(path, cmd, arg, fi, flags, data);
+	pthread_rwlock_unlock(&fsLock);
+	recordOp(OP_IOCTL, start, ret, 0);
+	return ret;
+}
+
+static int timed_rmdir(const char *path)
+{
+	unsigned long long start = nowNs();
+	int ret;
+
+	pthread_rwlock_wrlock(&fsLock);
+	ret = cs1550_rmdir(path);
+	pthread_rwlock_unlock(&fsLock);
+	recordOp(OP_RMDIR, start, ret, 0);
+	return ret;
+}
+
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	unsigned long long start = nowNs();
+	int ret;
+
+	//it writes out the open create batch, which changes the image
+	pthread_rwlock_wrlock(&fsLock);
+	ret = cs1550_fsync(path, datasync, fi);
+	pthread_rwlock_unlock(&fsLock);
+	recordOp(OP_FSYNC, start, ret, 0);
+	return ret;
+}
 
 //register our new functions as the implementations of the syscalls
-static struct fuse_operations hello_oper = {
-    .getattr	= cs1550_getattr,
-    .readdir	= cs1550_readdir,
-    .mkdir	= cs1550_mkdir,
-	.rmdir = cs1550_rmdir,
-    .read	= cs1550_read,
-    .write	= cs1550_write,
-	.mknod	= cs1550_mknod,
+//not static: cs1550_bench.c calls the handlers through it, fsck_cs1550.c
+//doesn't, and a static table would be unused there
+struct fuse_operations hello_oper = {
+    .getattr	= timed_getattr,
+    .readdir	= timed_readdir,
+    .mkdir	= timed_mkdir,
+	.rmdir = timed_rmdir,
+    .read	= timed_read,
+    .write	= timed_write,
+	.mknod	= timed_mknod,
 	.unlink = cs1550_unlink,
 	.truncate = cs1550_truncate,
-	.flush = cs1550_flush,
-	.open	= cs1550_open,
+	.flush = timed_flush,
+	.fsync = timed_fsync,
+	.open	= timed_open,
+	.ioctl	= timed_ioctl,
+	.init = cs1550_init,
+	.destroy = cs1550_destroy,
 };
 
-//Don't change this.
+/*
+ *Every change to the image goes through this daemon, and the kernel keeps
+ *its own size up to date on write, so it is safe to let it cache
+ *attributes and lookups for a long time and to use our inode numbers.
+ *Lookups that fail are cached for less time, since a clone made with
+ *CS1550_IOC_CLONE appears without the kernel seeing a create.
+ */
+#define NEGATIVE_TIMEOUT 5
+#define STRINGIFY(x) #x
+#define TOSTRING(x) STRINGIFY(x)
+#define CS1550_MOUNT_OPTS "-ouse_ino,attr_timeout=60,entry_timeout=60,negative_timeout=" \
+	TOSTRING(NEGATIVE_TIMEOUT) ",max_write=" TOSTRING(MAX_WRITE)
+
+//cs1550_bench.c includes this file and brings its own main
+#ifndef CS1550_NO_MAIN
 int main(int argc, char *argv[])
 {
-	return fuse_main(argc, argv, &hello_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int ret;
+
+	if(fuse_opt_parse(&args, &config, cs1550_opts, NULL)==-1){
+		return 1;
+	}
+	//kill -USR1 dumps the trace ring without stopping the mount
+	signal(SIGUSR1, traceSignal);
+	signal(SIGUSR2, defragSignal);
+	//find and open the backing files now, fuse_main changes to / when it daemonizes
+	setupDisks();
+	pthread_once(&diskOnce, openDisk);
+	if(config.fsck){
+		int repaired;
+		fsckImage(FSCK_REPAIR, stderr, &repaired);
+		//this mount doesn't use the index fsck skipped, so don't leave it for the next
+		unlink(idxPath);
+	}
+	fuse_opt_add_arg(&args, CS1550_MOUNT_OPTS);
+	ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	fuse_opt_free_args(&args);
+	return ret;
 }
+#endif
@@ -0,0 +1,371 @@
+/*
+	Benchmark for the cs1550 file system that runs without a mount.
+
+	It pulls in cs1550.c and calls the handlers in hello_oper directly
+	against a scratch .disk in a temporary directory, so it needs the FUSE
+	headers but not /dev/fuse or libfuse at run time. Build and run with
+
+		gcc -O2 -Wall `pkg-config fuse --cflags` cs1550_bench.c -o cs1550_bench -lpthread -lm
+		./cs1550_bench [iterations]
+
+	Every workload prints one JSON object per line on stdout. The stats
+	file from the run is printed to stderr at the end. The run fails if a
+	write far past the largest file size isn't refused with EFBIG, or if
+	the percentiles in the stats file don't come in order under the max.
+*/
+
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+//same size as the .disk the file system is meant to be mounted on
+#define BENCH_DISK_SIZE (5 * 1024 * 1024)
+#define BENCH_CHUNK 4096
+//rounds of 4096 byte appends each file gets in append_large
+#define BENCH_APPEND_ROUNDS 8
+
+//MAX_DIRS_IN_ROOT and MAX_FILES_IN_DIR aren't parenthesized
+#define BENCH_DIRS ((int)(MAX_DIRS_IN_ROOT))
+#define BENCH_FILES ((int)(MAX_FILES_IN_DIR))
+
+static int iterations = 20000;
+
+/*
+ *Latencies of every op in one workload, in ns, and how many of the ops
+ *returned an error.
+ */
+struct samples {
+	unsigned long long *ns;
+	int n;
+	int cap;
+	int errors;
+};
+
+static void addSample(struct samples *smp, unsigned long long ns){
+	if(smp->n==smp->cap){
+		smp->cap = smp->cap ? smp->cap*2 : 1024;
+		smp->ns = (unsigned long long *)realloc(smp->ns, smp->cap*sizeof(unsigned long long));
+	}
+	smp->ns[smp->n++] = ns;
+}
+
+#define TIME_OP(smp, call) do { \
+	unsigned long long t0 = nowNs(); \
+	if((call)<0){ \
+		(smp)->errors++; \
+	} \
+	addSample((smp), nowNs()-t0); \
+} while(0)
+
+static int cmpNs(const void *a, const void *b){
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+	return (x>y) - (x<y);
+}
+
+static unsigned long long percentile(struct samples *smp, double fraction){
+	int i = (int)(fraction*smp->n);
+	if(i>=smp->n){
+		i = smp->n-1;
+	}
+	return smp->ns[i];
+}
+
+/*
+ *Prints the result of one workload and empties smp for the next.
+ */
+static void report(const char *name, struct samples *smp, unsigned long long elapsed){
+	unsigned long long total = 0;
+	int i;
+
+	if(smp->n==0){
+		return;
+	}
+	for(i = 0; i<smp->n; i++){
+		total += smp->ns[i];
+	}
+	qsort(smp->ns, smp->n, sizeof(unsigned long long), cmpNs);
+	printf("{\"workload\": \"%s\", \"ops\": %d, \"errors\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+		"\"avg_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}\n",
+		name, smp->n, smp->errors, elapsed/1e9, smp->n/(elapsed/1e9),
+		total/smp->n, percentile(smp, 0.50), percentile(smp, 0.90),
+		percentile(smp, 0.99), smp->ns[smp->n-1]);
+	fflush(stdout);
+	smp->n = 0;
+	smp->errors = 0;
+}
+
+/*
+ *Zeroes .disk and forgets everything cached from it.
+ */
+static void resetImage(){
+	pthread_once(&diskOnce, openDisk);
+	ftruncate(disks[0].fd, 0);
+	ftruncate(disks[0].fd, BENCH_DISK_SIZE);
+	pthread_mutex_lock(&cacheLock);
+	rootCached = 0;
+	memset(dirCached, 0, sizeof(dirCached));
+	pthread_mutex_unlock(&cacheLock);
+	memset(negCache, 0, sizeof(negCache));
+	memset(rmwOffset, 0, sizeof(rmwOffset));
+	pthread_once(&mapOnce, loadMap);
+	memset(&mapCache, 0, sizeof(mapCache));
+	freeHint = 0;
+	batchDir = -1;
+	batchCreates = 0;
+	batchMapLo = -1;
+	batchMapHi = -1;
+}
+
+static void dirPath(char *out, int d){
+	sprintf(out, "/d%d", d);
+}
+
+static void filePath(char *out, int d, int f){
+	sprintf(out, "/d%d/f%d.dat", d, f);
+}
+
+static int countEntries(void *buf, const char *name, const struct stat *stbuf, off_t off){
+	(void) name;
+	(void) stbuf;
+	(void) off;
+	(*(int *)buf)++;
+	return 0;
+}
+
+/*
+ *Fills the image with every directory and every file it can hold.
+ */
+static void populate(struct samples *mkdirs, struct samples *mknods){
+	char path[32];
+	int d;
+	int f;
+
+	for(d = 0; d<BENCH_DIRS; d++){
+		dirPath(path, d);
+		TIME_OP(mkdirs, hello_oper.mkdir(path, 0755));
+	}
+	for(d = 0; d<BENCH_DIRS; d++){
+		for(f = 0; f<BENCH_FILES; f++){
+			filePath(path, d, f);
+			TIME_OP(mknods, hello_oper.mknod(path, S_IFREG | 0644, 0));
+		}
+	}
+}
+
+static void benchMetadata(struct samples *smp){
+	struct samples mknods = {NULL, 0, 0, 0};
+	unsigned long long start;
+	struct stat st;
+	char path[32];
+	int i;
+
+	resetImage();
+	start = nowNs();
+	populate(smp, &mknods);
+	report("mkdir", smp, nowNs()-start);
+	report("mknod", &mknods, nowNs()-start);
+	free(mknods.ns);
+
+	start = nowNs();
+	for(i = 0; i<iterations; i++){
+		filePath(path, rand() % BENCH_DIRS, rand() % BENCH_FILES);
+		TIME_OP(smp, hello_oper.getattr(path, &st));
+	}
+	report("getattr_hit", smp, nowNs()-start);
+
+	start = nowNs();
+	for(i = 0; i<iterations; i++){
+		sprintf(path, "/d%d/nope%d", rand() % BENCH_DIRS, rand() % 1000);
+		TIME_OP(smp, hello_oper.getattr(path, &st));
+	}
+	report("getattr_miss", smp, nowNs()-start);
+
+	//the same few missing names over and over, the way shells and git probe
+	start = nowNs();
+	for(i = 0; i<iterations; i++){
+		sprintf(path, "/d%d/probe%d", rand() % 4, rand() % 16);
+		TIME_OP(smp, hello_oper.getattr(path, &st));
+	}
+	report("getattr_probe", smp, nowNs()-start);
+
+	start = nowNs();
+	for(i = 0; i<iterations/10; i++){
+		int entries = 0;
+		dirPath(path, rand() % BENCH_DIRS);
+		TIME_OP(smp, hello_oper.readdir(path, &entries, countEntries, 0, NULL));
+	}
+	report("readdir", smp, nowNs()-start);
+}
+
+static void benchData(struct samples *smp){
+	static char data[BENCH_CHUNK];
+	static char out[BENCH_CHUNK];
+	struct fuse_file_info fi[BENCH_FILES];
+	size_t sizes[BENCH_FILES];
+	unsigned long long start;
+	char path[32];
+	int f;
+	int r;
+	int i;
+
+	for(i = 0; i<BENCH_CHUNK; i++){
+		data[i] = 'a' + (i % 26);
+	}
+
+	//small appends, kept inside the first block of each file
+	resetImage();
+	hello_oper.mkdir("/small", 0755);
+	for(f = 0; f<BENCH_FILES; f++){
+		sprintf(path, "/small/f%d", f);
+		hello_oper.mknod(path, S_IFREG | 0644, 0);
+		memset(&fi[f], 0, sizeof(fi[f]));
+		hello_oper.open(path, &fi[f]);
+	}
+	start = nowNs();
+	for(r = 0; r<BLOCK_SIZE/64-1; r++){
+		for(f = 0; f<BENCH_FILES; f++){
+			sprintf(path, "/small/f%d", f);
+			TIME_OP(smp, hello_oper.write(path, data, 64, r*64, &fi[f]));
+		}
+	}
+	report("append_small", smp, nowNs()-start);
+
+	//large appends to files that sit next to each other, so every round
+	//has to move the neighbours out of the way
+	resetImage();
+	hello_oper.mkdir("/large", 0755);
+	for(f = 0; f<BENCH_FILES; f++){
+		sprintf(path, "/large/f%d", f);
+		hello_oper.mknod(path, S_IFREG | 0644, 0);
+		memset(&fi[f], 0, sizeof(fi[f]));
+		hello_oper.open(path, &fi[f]);
+		sizes[f] = 0;
+	}
+	start = nowNs();
+	for(r = 0; r<BENCH_APPEND_ROUNDS; r++){
+		for(f = 0; f<BENCH_FILES; f++){
+			sprintf(path, "/large/f%d", f);
+			TIME_OP(smp, hello_oper.write(path, data, BENCH_CHUNK, sizes[f], &fi[f]));
+			sizes[f] += BENCH_CHUNK;
+		}
+	}
+	report("append_large", smp, nowNs()-start);
+
+	start = nowNs();
+	for(f = 0; f<BENCH_FILES; f++){
+		sprintf(path, "/large/f%d", f);
+		for(r = 0; r<BENCH_APPEND_ROUNDS; r++){
+			TIME_OP(smp, hello_oper.read(path, out, BENCH_CHUNK, r*BENCH_CHUNK, &fi[f]));
+		}
+	}
+	report("read_seq", smp, nowNs()-start);
+
+	start = nowNs();
+	for(i = 0; i<iterations; i++){
+		f = rand() % BENCH_FILES;
+		r = rand() % (BENCH_APPEND_ROUNDS*BENCH_CHUNK/BLOCK_SIZE - BENCH_CHUNK/BLOCK_SIZE);
+		sprintf(path, "/large/f%d", f);
+		TIME_OP(smp, hello_oper.read(path, out, BENCH_CHUNK, r*BLOCK_SIZE, &fi[f]));
+	}
+	report("read_rand", smp, nowNs()-start);
+}
+
+/*
+ *Checks that writes ending past the largest file a file can be are
+ *refused with -EFBIG, however far past. Returns the number that aren't.
+ */
+static int checkFarWrites(){
+	static const off_t offsets[] = {
+		(off_t)MAX_BLOCK_FOR_FILE*BLOCK_SIZE-50,
+		(off_t)1 << 31,
+		(off_t)1 << 40,
+	};
+	struct fuse_file_info fi;
+	char data[100];
+	int bad = 0;
+	size_t i;
+
+	resetImage();
+	memset(data, 'x', sizeof(data));
+	hello_oper.mkdir("/far", 0755);
+	hello_oper.mknod("/far/f.dat", S_IFREG | 0644, 0);
+	memset(&fi, 0, sizeof(fi));
+	hello_oper.open("/far/f.dat", &fi);
+	for(i = 0; i<sizeof(offsets)/sizeof(offsets[0]); i++){
+		int ret = hello_oper.write("/far/f.dat", data, sizeof(data), offsets[i], &fi);
+		if(ret!=-EFBIG){
+			fprintf(stderr, "cs1550_bench: write at %lld returned %d, not -EFBIG\n", (long long)offsets[i], ret);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+/*
+ *Checks that the percentiles of every op in the stats file come in
+ *order and under the max. Returns the number of ops that don't.
+ */
+static int checkPercentiles(char *text){
+	char *line;
+	int bad = 0;
+
+	for(line = strtok(text, "\n"); line!=NULL; line = strtok(NULL, "\n")){
+		char op[32];
+		unsigned long calls, errors, bytes;
+		unsigned long long avg, p50, p90, p99, max;
+		if(sscanf(line, "%31s calls %lu errors %lu bytes %lu avg_ns %llu p50_ns %llu p90_ns %llu p99_ns %llu max_ns %llu",
+			op, &calls, &errors, &bytes, &avg, &p50, &p90, &p99, &max)!=9){
+			continue;
+		}
+		if(p50>p90||p90>p99||p99>max){
+			fprintf(stderr, "cs1550_bench: %s p50_ns %llu p90_ns %llu p99_ns %llu max_ns %llu out of order\n",
+				op, p50, p90, p99, max);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+int main(int argc, char *argv[])
+{
+	struct samples smp = {NULL, 0, 0, 0};
+	char dir[] = "/tmp/cs1550_bench.XXXXXX";
+	char text[STATS_BUF];
+	struct fuse_file_info fi;
+	int failed = 0;
+	int len;
+	int fd;
+
+	if(argc>1){
+		iterations = atoi(argv[1]);
+	}
+	if(mkdtemp(dir)==NULL||chdir(dir)!=0){
+		perror("cs1550_bench");
+		return 1;
+	}
+	fd = open(".disk", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd==-1||ftruncate(fd, BENCH_DISK_SIZE)!=0){
+		perror("cs1550_bench: .disk");
+		return 1;
+	}
+	close(fd);
+	srand(1550);
+
+	benchMetadata(&smp);
+	benchData(&smp);
+	failed += checkFarWrites();
+
+	memset(&fi, 0, sizeof(fi));
+	len = hello_oper.read(STATS_PATH, text, sizeof(text)-1, 0, &fi);
+	if(len>0){
+		fwrite(text, 1, len, stderr);
+		text[len] = '\0';
+		failed += checkPercentiles(text);
+	}
+
+	free(smp.ns);
+	unlink(".disk");
+	chdir("/");
+	rmdir(dir);
+	return failed ? 1 : 0;
+}
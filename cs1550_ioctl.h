@@ -0,0 +1,28 @@
+/*
+	ioctls the cs1550 file system understands, for programs that want to
+	use them on files inside a mount.
+
+	CS1550_IOC_CLONE, on an open file, makes a copy of it at dest, a path
+	inside the same mount such as "/dir/name.ext", which must not exist
+	yet. The copy shares the original's blocks until either is written,
+	so nothing is read or written through the kernel:
+
+		struct cs1550_clone req;
+		strcpy(req.dest, "/templates/copy.txt");
+		ioctl(fd, CS1550_IOC_CLONE, &req);
+*/
+
+#ifndef CS1550_IOCTL_H
+#define CS1550_IOCTL_H
+
+#include <sys/ioctl.h>
+
+#define CS1550_CLONE_PATH 32
+
+struct cs1550_clone {
+	char dest[CS1550_CLONE_PATH];
+};
+
+#define CS1550_IOC_CLONE _IOW('c', 1, struct cs1550_clone)
+
+#endif
@@ -0,0 +1,76 @@
+/*
+	Consistency checker for a cs1550 .disk, the fsck.cs1550 target.
+
+	It pulls in cs1550.c, like cs1550_bench.c does, and checks the .disk
+	in the given directory (the current one by default) with fsckImage.
+	Build and run with
+
+		gcc -O2 -Wall `pkg-config fuse --cflags` fsck_cs1550.c -o fsck.cs1550 -lpthread -lm
+		./fsck.cs1550 [-y] [-f] [-d a:b:...] [-s stripe] [directory]
+
+		-y	rebuild the map if it doesn't match the directories
+		-f	fast, don't decompress compressed files to check them
+		-d	the backing files of a striped image, as for -o disk
+		-s	its stripe unit in blocks, as for -o stripe
+
+	It checks the blocks in the image itself, never the .disk.idx a clean
+	unmount leaves next to it, and leaves that file alone. A repair changes
+	the image, so the next mount finds the index stale and ignores it.
+
+	The image must not be mounted. The exit status is the one fsck(8)
+	uses: 0 if the image is clean, 1 if everything found was fixed, 4 if
+	problems are left, 8 if the image couldn't be opened.
+*/
+
+#define CS1550_NO_MAIN
+#define CS1550_FSCK
+#include "cs1550.c"
+
+int main(int argc, char *argv[])
+{
+	int flags = FSCK_FULL;
+	int repaired;
+	int problems;
+	int opt;
+
+	while((opt = getopt(argc, argv, "yfd:s:"))!=-1){
+		switch(opt){
+			case 'y':
+				flags |= FSCK_REPAIR;
+				break;
+			case 'f':
+				flags &= ~FSCK_FULL;
+				break;
+			case 'd':
+				config.disks = optarg;
+				break;
+			case 's':
+				config.stripe = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-y] [-f] [-d a:b:...] [-s stripe] [directory]\n", argv[0]);
+				return 16;
+		}
+	}
+	if(optind<argc&&chdir(argv[optind])!=0){
+		perror(argv[optind]);
+		return 8;
+	}
+	setupDisks();
+	//keep the checksums up to date, and checked, if the image has them
+	if(access(crcPath, F_OK)==0){
+		config.checksum = 1;
+	}
+	pthread_once(&diskOnce, openDisk);
+	if(disks[0].fd==-1){
+		return 8;
+	}
+
+	problems = fsckImage(flags, stdout, &repaired);
+	if(problems==0){
+		printf("clean\n");
+		return 0;
+	}
+	printf("%d problem%s found\n", problems, problems==1 ? "" : "s");
+	return problems>repaired ? 4 : 1;
+}
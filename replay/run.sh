@@ -0,0 +1,246 @@
+#!/bin/sh
+#
+# End-to-end replay suite. Builds the daemon, mounts it on a scratch
+# image through the kernel, replays the traces in traces/ and the fio
+# jobs in fio/ against it, each on a fresh image, and compares what they
+# measured with the stored baselines. Unlike cs1550_bench.c, everything
+# goes through the kernel, so its caching and request splitting are part
+# of what is measured.
+#
+#	replay/run.sh [-r] [-t percent] [-o option] ...
+#
+#	-r	record this machine's timings in baselines/<host>.txt
+#		instead of comparing with them
+#	-t	how much worse than its recorded value a timing may get
+#		before it fails (default 20 percent)
+#	-o	an -o option for the daemon, e.g. -o small_files
+#
+# baselines/default.txt is what has to hold on any machine: no errors,
+# exact byte counts, the write request size the kernel is held to, and
+# generous time ceilings. Timings only mean something on the machine
+# they were taken on, so they are compared once recorded there with -r.
+#
+# Exits 0 if everything is within its baseline, 1 if not, and 77 (the
+# automake code for a skipped test) if the suite can't run here: no
+# /dev/fuse, no fusermount or no libfuse to build against. Without fio
+# the fio jobs are skipped and the traces still run.
+
+here=$(cd "$(dirname "$0")" && pwd)
+top=$(dirname "$here")
+record=0
+threshold=20
+opts=""
+
+while getopts rt:o: flag; do
+	case $flag in
+		r) record=1 ;;
+		t) threshold=$OPTARG ;;
+		o) opts="$opts -o $OPTARG" ;;
+		*) echo "usage: $0 [-r] [-t percent] [-o option] ..." >&2; exit 2 ;;
+	esac
+done
+
+skip(){
+	echo "SKIP: $*"
+	exit 77
+}
+
+[ -c /dev/fuse ] || skip "no /dev/fuse"
+command -v fusermount > /dev/null 2>&1 || skip "no fusermount"
+pkg-config --exists fuse 2> /dev/null || skip "no libfuse to build against (pkg-config fuse)"
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/cs1550_replay.XXXXXX") || exit 1
+mnt=$work/mnt
+results=$work/results
+daemon=""
+failed=0
+mkdir "$mnt"
+: > "$results"
+
+unmountImage(){
+	if [ -n "$daemon" ]; then
+		fusermount -u "$mnt" 2> /dev/null
+		wait "$daemon"
+		daemon=""
+	fi
+}
+
+cleanup(){
+	unmountImage
+	rm -rf "$work"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+${CC:-cc} -O2 $(pkg-config fuse --cflags) "$top/cs1550.c" -o "$work/cs1550" \
+	$(pkg-config fuse --libs) -lpthread -lm || { echo "FAIL: cs1550.c doesn't build"; exit 1; }
+
+# mountImage: a fresh, zeroed image, mounted at $mnt
+mountImage(){
+	rm -rf "$work/.disk" "$work"/.disk.* "$work/scratch"
+	mkdir "$work/scratch"
+	dd if=/dev/zero of="$work/.disk" bs=1M count=${CS1550_REPLAY_MB:-5} 2> /dev/null
+	(cd "$work" && exec ./cs1550 -f $opts "$mnt") > "$work/daemon.log" 2>&1 &
+	daemon=$!
+	tries=0
+	until grep -qs " $mnt fuse" /proc/mounts; do
+		tries=$((tries+1))
+		if [ $tries -gt 100 ] || ! kill -0 "$daemon" 2> /dev/null; then
+			echo "FAIL: the daemon didn't mount"
+			cat "$work/daemon.log"
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+now(){
+	date +%s.%N
+}
+
+result(){
+	echo "$1 $2 $3" >> "$results"
+}
+
+# statDelta workload before after: what the daemon counted in between.
+# getattr misses are part of every workload, so they aren't errors.
+statDelta(){
+	awk -v w="$1" '
+		$2=="calls" {
+			n = FNR==NR ? -1 : 1
+			if($1!="getattr"){
+				errors += n*$5
+			}
+			if($1=="write"){
+				calls += n*$3
+				bytes += n*$7
+			}
+		}
+		END {
+			print w, "errors", errors+0
+			print w, "write_calls", calls+0
+			print w, "write_bytes", bytes+0
+			if(calls>0){
+				print w, "write_request_avg", int(bytes/calls)
+			}
+		}' "$2" "$3" >> "$results"
+}
+
+# measure workload command ...: runs the command on a fresh mount and
+# records how long it took and what the daemon counted
+measure(){
+	name=$1
+	shift
+	echo "== $name"
+	mountImage
+	cat "$mnt/.cs1550_stats" > "$work/before"
+	start=$(now)
+	"$@" > "$work/out" 2>&1
+	status=$?
+	if [ $status -ne 0 ]; then
+		echo "FAIL: $name exited with $status"
+		failed=1
+	fi
+	end=$(now)
+	cat "$mnt/.cs1550_stats" > "$work/after"
+	unmountImage
+	result "$name" seconds "$(echo "$start $end" | awk '{printf "%.3f", $2-$1}')"
+	statDelta "$name" "$work/before" "$work/after"
+	grep '^metric ' "$work/out" | while read -r tag metric value; do
+		result "$name" "$metric" "$value"
+	done
+	grep -v '^metric ' "$work/out"
+}
+
+for trace in untar stat_storm log_append parallel_readers; do
+	measure $trace sh "$here/traces/$trace.sh" "$mnt" "$work/scratch"
+done
+
+# runFio job: one fio job file, its results in terse version 3 format
+runFio(){
+	mkdir "$mnt/fio"
+	FIO_DIR=$mnt/fio fio --output-format=terse --terse-version=3 "$1" > "$work/fio" || return 1
+	awk -F';' '
+		{ error += $5; rio += $6; rbw += $7; riops += $8; wio += $47; wbw += $48; wiops += $49 }
+		END {
+			print "metric fio_error", error+0
+			if(rio>0){
+				print "metric read_kbs", rbw
+				print "metric read_iops", riops
+			}
+			if(wio>0){
+				print "metric write_kbs", wbw
+				print "metric write_iops", wiops
+			}
+		}' "$work/fio"
+}
+
+if command -v fio > /dev/null 2>&1; then
+	for job in "$here"/fio/*.fio; do
+		measure "$(basename "$job" .fio)" runFio "$job"
+	done
+else
+	echo "== fio not installed, skipping the fio jobs"
+fi
+
+echo "== results"
+cat "$results"
+
+echo "== checks"
+awk '
+	FNR==NR { got[$1" "$2] = $3; next }
+	/^#/ || NF<4 { next }
+	{
+		key = $1" "$2
+		if(!(key in got)){
+			printf "skip %s %s, not run\n", $1, $2
+			next
+		}
+		v = got[key]+0
+		ok = ($3=="eq"&&v==$4+0) || ($3=="max"&&v<=$4+0) || ($3=="min"&&v>=$4+0)
+		printf "%-4s %s %s %s (%s %s)\n", ok ? "ok" : "FAIL", $1, $2, got[key], $3, $4
+		if(!ok){
+			bad = 1
+		}
+	}
+	END { exit bad }' "$results" "$here/baselines/default.txt" || failed=1
+
+host=$here/baselines/$(hostname -s 2> /dev/null || hostname).txt
+if [ $record -eq 1 ]; then
+	{
+		echo "# Timings recorded by run.sh -r on $(hostname) at $(date -u '+%Y-%m-%d %H:%M UTC')."
+		echo "#	workload metric value lower|higher (which way is better)"
+		awk '$2=="seconds" { print $1, $2, $3, "lower" }
+			$2 ~ /_(iops|kbs)$/ { print $1, $2, $3, "higher" }' "$results"
+	} > "$host"
+	echo "recorded $host"
+elif [ -f "$host" ]; then
+	awk -v t="$threshold" '
+		FNR==NR { got[$1" "$2] = $3; next }
+		/^#/ || NF<4 { next }
+		{
+			key = $1" "$2
+			if(!(key in got)){
+				printf "skip %s %s, not run\n", $1, $2
+				next
+			}
+			v = got[key]+0
+			if($4=="lower"){
+				limit = $3*(1+t/100)
+				ok = v<=limit
+			}
+			else{
+				limit = $3*(1-t/100)
+				ok = v>=limit
+			}
+			printf "%-4s %s %s %s (baseline %s, limit %.3f)\n", ok ? "ok" : "FAIL", $1, $2, got[key], $3, limit
+			if(!ok){
+				bad = 1
+			}
+		}
+		END { exit bad }' "$results" "$host" || failed=1
+else
+	echo "no timings recorded for this machine, run $0 -r to record them"
+fi
+
+exit $failed
@@ -0,0 +1,40 @@
+# Helpers the traces share. Sourced, not run.
+
+# makeFile path size seed: size bytes of made-up source text
+makeFile(){
+	yes "int x$3 = $3; /* $3 */" | head -c "$2" > "$1"
+}
+
+# makeTree dir: 8 directories of 12 files, from a few bytes to a few
+# blocks each like a source tree, 571056 bytes in all. The sizes are the
+# same every run, baselines/default.txt counts on them.
+makeTree(){
+	d=0
+	while [ $d -lt 8 ]; do
+		mkdir -p "$1/src$d"
+		f=0
+		while [ $f -lt 12 ]; do
+			i=$((d*12+f))
+			makeFile "$1/src$d/f$f.c" $((i*2741%12000+1)) $i
+			f=$((f+1))
+		done
+		d=$((d+1))
+	done
+}
+
+# countMismatches a b: how many files under a differ from, or are missing
+# in, the same place under b
+countMismatches(){
+	n=0
+	for file in $(cd "$1" && find . -type f | sort); do
+		if ! cmp -s "$1/$file" "$2/$file"; then
+			n=$((n+1))
+		fi
+	done
+	echo $n
+}
+
+# metric name value: a result for run.sh to compare with the baselines
+metric(){
+	echo "metric $1 $2"
+}
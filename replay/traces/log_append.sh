@@ -0,0 +1,25 @@
+#!/bin/sh
+# A service logging a line at a time: open with O_APPEND, write one short
+# line, close, 2000 times, so every line is its own small write to the
+# end of a growing file.
+#	log_append.sh mountpoint scratch
+. "$(dirname "$0")/common.sh"
+mnt=$1
+scratch=$2
+lines=2000
+
+mkdir "$mnt/log"
+: > "$scratch/app.log"
+i=0
+while [ $i -lt $lines ]; do
+	line=$(printf '%05d GET /index.html 200 1550 "replay" 0.001234 ok......\n' $i)
+	echo "$line" >> "$mnt/log/app.log"
+	echo "$line" >> "$scratch/app.log"
+	i=$((i+1))
+done
+metric size "$(wc -c < "$mnt/log/app.log")"
+if cmp -s "$scratch/app.log" "$mnt/log/app.log"; then
+	metric mismatched 0
+else
+	metric mismatched 1
+fi
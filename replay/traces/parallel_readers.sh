@@ -0,0 +1,36 @@
+#!/bin/sh
+# Several processes reading the same files at once, each start to end
+# over and over, like workers sharing a data set. The first pass of each
+# file comes from the daemon, later ones mostly from the page cache.
+#	parallel_readers.sh mountpoint scratch
+. "$(dirname "$0")/common.sh"
+mnt=$1
+scratch=$2
+files=4
+readers=4
+passes=8
+
+mkdir "$mnt/data"
+f=0
+while [ $f -lt $files ]; do
+	yes "record $f of the shared data set" | head -c 262144 > "$scratch/d$f.dat"
+	cp "$scratch/d$f.dat" "$mnt/data/d$f.dat"
+	f=$((f+1))
+done
+want=$(cat "$scratch"/d*.dat | cksum)
+
+r=0
+while [ $r -lt $readers ]; do
+	(
+		p=0
+		while [ $p -lt $passes ]; do
+			if [ "$(cat "$mnt"/data/d*.dat | cksum)" != "$want" ]; then
+				echo bad
+			fi
+			p=$((p+1))
+		done
+	) > "$scratch/reader$r" &
+	r=$((r+1))
+done
+wait
+metric mismatched "$(cat "$scratch"/reader* | wc -l)"
@@ -0,0 +1,30 @@
+#!/bin/sh
+# What a build does before it compiles anything: list every directory,
+# stat every file, and probe for headers that aren't there, over and
+# over. Mostly getattr, lookups and readdir, hits and misses.
+#	stat_storm.sh mountpoint scratch
+. "$(dirname "$0")/common.sh"
+mnt=$1
+scratch=$2
+rounds=20
+
+makeTree "$scratch/tree"
+cp -r "$scratch/tree/." "$mnt"
+found=0
+r=0
+while [ $r -lt $rounds ]; do
+	for dir in "$mnt"/src*; do
+		ls -l "$dir" > /dev/null
+		stat "$dir"/*.c > /dev/null
+		p=0
+		while [ $p -lt 8 ]; do
+			if [ -e "$dir/miss$p.h" ]; then
+				found=$((found+1))
+			fi
+			p=$((p+1))
+		done
+	done
+	r=$((r+1))
+done
+metric phantoms $found
+metric mismatched "$(countMismatches "$scratch/tree" "$mnt")"
@@ -0,0 +1,13 @@
+#!/bin/sh
+# Unpacks a source tarball into the mount, the way installing or checking
+# out a project does: mkdir, then create and write file after file.
+#	untar.sh mountpoint scratch
+. "$(dirname "$0")/common.sh"
+mnt=$1
+scratch=$2
+
+makeTree "$scratch/tree"
+tar -cf "$scratch/tree.tar" -C "$scratch/tree" .
+# tar can't set times or modes here, nothing implements utimens or chmod
+tar -xmf "$scratch/tree.tar" -C "$mnt" --no-same-owner --no-same-permissions 2>/dev/null
+metric mismatched "$(countMismatches "$scratch/tree" "$mnt")"